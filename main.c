@@ -7,26 +7,91 @@
 #include <string.h>
 #include <ctype.h>
 #include <locale.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 
 #define ROWS 11 // y
 #define COLS 32 // x
 
+#define TICK_NS 50000000L      // 20 ticks per second
+#define TICK_MAX_CATCHUP 5
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define GATE_PERIOD 20         // Ticks between '~' gate toggles
+#define PATROL_PERIOD 4        // Ticks between patrolling hazard steps
+
+#define LAYER_BASE 0           // Terrain, wiped where the player walks
+#define LAYER_PERSIST 1        // Terrain that survives the player
+#define LAYER_ENTITY 2         // Boxes and patrolling hazards
+#define LAYER_DECAL 3          // Cosmetic, drawn over open floor only
+#define LAYER_COUNT 4
+
+#define MAX_BOXES 15
+#define MAP_PATH_SIZE 256
+#define SAVE_FILE "quicksave.sav"
+#define SAVE_MAGIC 0x56534743u    // "CGSV"
+#define SAVE_VERSION 1
+
+#define CELL_RENDER_SIZE 32    // Cursor move, style, glyph and reset for one cell
+#define FRAME_BUFFER_SIZE (ROWS * (COLS * CELL_RENDER_SIZE + 1) + 1)
+#define FOG_RADIUS 7
+#define GAME_STATUS_ROW (ROWS + 4)    // Fixed message row under the help lines
+#define EDITOR_STATUS_ROW (ROWS + 1)  // Blank row between the editor map and its help
+#define OUTPUT_WINDOW 4096                   // Bytes sent past the last answered position report
+#define PROBE_TIMEOUT_NS 1000000000LL        // Ask again when a report never comes back
+#define PROBE_DRAIN_NS 100000000LL           // How long leaving gameplay waits for the last report
+#define OUTPUT_RETRY_NS 50000000LL           // Back-off after the terminal refused a write
+#define TRAVEL_UNREACHED (ROWS * COLS)
+#define TRAVEL_QUEUE_SIZE (ROWS * COLS + 1)
+#define BROADCAST_NAME "/cgame-broadcast"
+#define BROADCAST_MAGIC 0x42534743u   // "CGSB"
+#define BROADCAST_SLOTS 8
+#define SPECTATE_POLL_US 10000
+
+#define WRITER_QUEUE_SIZE 8
+#define AUTOSAVE_FILE "autosave.map"
+#define AUTOSAVE_SECONDS 30
+#define MAP_FILE_SIZE (3 * (ROWS * (COLS + 1) + 16) + MAP_PATH_SIZE + 16)
+
 const char * next_map = "";
+char next_map_buffer[MAP_PATH_SIZE];
+char current_map[MAP_PATH_SIZE];
 volatile int escape_flag = 0;
-volatile char game_state[ROWS][COLS];
-volatile char persist_array[ROWS][COLS];
+volatile char game_state[ROWS][COLS];          // Composite of the layers, rebuilt only where dirty
+volatile char layers[LAYER_COUNT][ROWS][COLS];
 volatile int playerX = COLS / 2;
 volatile int playerY = ROWS / 2;
 volatile int collision = 1;
 volatile int death = 0;
 volatile int death_text_printed = 0;
 int init = 1;
-int max_boxes = 15;
+int max_boxes = MAX_BOXES;
 volatile int box_count = 0;
 volatile int menu_state = -1;
 volatile int win_map = 0;
+volatile int tick_stop = 0;
+
+pthread_mutex_t game_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tick_cond = PTHREAD_COND_INITIALIZER;
+
+#define KEYBIND_COUNT 24
+#define KEYBIND_FILE "keybinds.cfg"
+#define INPUT_BUFFER_SIZE 256
+#define ESCAPE_DELAY_MS 25     // Wait for the rest of a split escape sequence
 
-char keybinds[14] = {'w','a','s','d','r','q','\n','n','\\','e','1','2','3','f'};
+char keybinds[KEYBIND_COUNT] = {'w','a','s','d','r','q','\n','n','\\','e','1','2','3','f','k','l','o','t','m','x','g','c','y','h'};
+const char* keybind_names[KEYBIND_COUNT] = {"up","left","down","right","restart","quit","enter","next","noclip","layer","save","export","menu","set_next","quick_save","quick_load","fog","travel","mark","fill","flood","copy","paste","replace"};
+unsigned char keymap[256];     // Key byte to keybinds index + 1, 0 when unbound
+
+unsigned char input_buffer[INPUT_BUFFER_SIZE];
+int input_len = 0;
+int input_pos = 0;
 
 typedef struct {
 	int x;
@@ -45,21 +110,737 @@ box** boxes;
 
 char game_map[ROWS * (COLS + 1) + 1];
 char persist_map[ROWS * (COLS + 1) + 1];
+char decal_map[ROWS * (COLS + 1) + 1];
+
+const char* layer_names[LAYER_COUNT] = {"Regular","Persist","Entity","Decal"};
+unsigned char composite_dirty[ROWS][COLS];
+int dirty_cells[ROWS * COLS];
+int dirty_count = 0;
+int composed_playerX = -1;
+int composed_playerY = -1;
+
+// Cells that need repainting since the last frame reached the terminal
+int screen_valid = 0;
+unsigned char render_pending[ROWS][COLS];
+int render_cells[ROWS * COLS];
+int render_count = 0;
+
+// Output pacing, frames are held back while the terminal is still draining
+int frame_pending = 0;
+int bytes_in_flight = 0;
+long long output_retry_ns = 0;
+int full_frame_size = FRAME_BUFFER_SIZE;
+
+// Fog of war, '#' blocks line of sight
+int fog_enabled = 0;
+int fog_stale = 1;
+unsigned int fog_generation = 0;
+unsigned int lit_generation[ROWS][COLS];
+unsigned char visible[ROWS][COLS];
+unsigned char seen[ROWS][COLS];
+char remembered[ROWS][COLS];
+int visible_cells[ROWS * COLS];
+int visible_count = 0;
+int lit_cells[ROWS * COLS];
+int lit_count = 0;
+// Travel command, distances to the cached target over cells that are safe to walk
+int travel_selecting = 0;
+int travel_cursorX = 0;
+int travel_cursorY = 0;
+int travel_targetX = -1;
+int travel_targetY = -1;
+int travel_distance[ROWS][COLS];
+int travel_queue[TRAVEL_QUEUE_SIZE];
+unsigned char travel_queued[ROWS][COLS];
+int travel_head = 0;
+int travel_tail = 0;
+const int travel_dirs[4][2] = {{0,-1},{-1,0},{0,1},{1,0}};
+
+const int fog_octants[8][4] = {{1,0,0,1},{0,1,1,0},{0,-1,1,0},{-1,0,0,1},{-1,0,0,-1},{0,-1,-1,0},{0,1,-1,0},{1,0,0,-1}};
+
+typedef struct {
+	int width;
+	int height;
+	char cells[ROWS][COLS];
+} edit_clipboard;
+
+// Bulk edit selection, the marked corner and the cursor span a rectangle
+int edit_markX = -1;
+int edit_markY = -1;
+edit_clipboard clipboard = { .width = 0, .height = 0 };
+
+// Cells overwritten by the current edit, so an edit that leaves more boxes
+// than a map can load is rolled back instead of failing when played
+typedef struct {
+	int cell;
+	char glyph;
+	char entity;
+} edit_undo;
+
+edit_undo edit_log[ROWS * COLS];
+int edit_log_count = 0;
+int edit_boxes = 0;
+
+// Build with -DTRACE to record spans into per-thread buffers and write a
+// Chrome/Perfetto trace (CGAME_TRACE_FILE, default trace.json) at exit
+#ifdef TRACE
+#define TRACE_BUFFER_EVENTS 65536
+
+typedef struct {
+	const char* name;
+	unsigned long long start;
+	unsigned long long duration;
+} trace_event;
+
+typedef struct trace_buffer {
+	struct trace_buffer* next;
+	const char* thread_name;
+	int tid;
+	int count;
+	int dropped;
+	trace_event events[TRACE_BUFFER_EVENTS];
+} trace_buffer;
+
+typedef struct {
+	const char* name;
+	unsigned long long start;
+} trace_span;
+
+trace_buffer* trace_buffers = NULL;
+int trace_next_tid = 0;
+unsigned long long trace_epoch = 0;
+__thread trace_buffer* trace_local = NULL;
+
+unsigned long long trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+trace_buffer* trace_thread_buffer() {
+	if (trace_local == NULL) {
+		trace_buffer* buffer = calloc(1, sizeof(trace_buffer));
+		if (buffer == NULL) {
+			perror("Failed to allocate trace buffer");
+			exit(EXIT_FAILURE);
+		}
+		buffer->tid = __atomic_fetch_add(&trace_next_tid, 1, __ATOMIC_RELAXED);
+		buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+		trace_local = buffer;
+	}
+	return trace_local;
+}
+
+void trace_thread_name(const char* name) {
+	trace_thread_buffer()->thread_name = name;
+}
+
+trace_span trace_begin(const char* name) {
+	return (trace_span){ name, trace_now() };
+}
+
+// Only the owning thread writes its buffer, the count is published last
+void trace_end(trace_span* span) {
+	trace_buffer* buffer = trace_thread_buffer();
+	const int index = buffer->count;
+	if (index >= TRACE_BUFFER_EVENTS) {
+		buffer->dropped++;
+		return;
+	}
+	buffer->events[index] = (trace_event){ span->name, span->start, trace_now() - span->start };
+	__atomic_store_n(&buffer->count, index + 1, __ATOMIC_RELEASE);
+}
+
+void trace_write() {
+	const char* filepath = getenv("CGAME_TRACE_FILE");
+	if (filepath == NULL) {
+		filepath = "trace.json";
+	}
+	FILE* trace_file = fopen(filepath, "w");
+	if (trace_file == NULL) {
+		perror("fopen");
+		return;
+	}
+	fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	int first = 1;
+	for (trace_buffer* buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer != NULL; buffer = buffer->next) {
+		if (buffer->thread_name != NULL) {
+			fprintf(trace_file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",", buffer->tid, buffer->thread_name);
+			first = 0;
+		}
+		const int count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < count; i++) {
+			const trace_event* event = &buffer->events[i];
+			fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				first ? "" : ",", event->name, buffer->tid,
+				(double)(event->start - trace_epoch) / 1000.0, (double)event->duration / 1000.0);
+			first = 0;
+		}
+		if (buffer->dropped > 0) {
+			fprintf(stderr, "trace: dropped %d events on thread %d\n", buffer->dropped, buffer->tid);
+		}
+	}
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+}
+
+void trace_init() {
+	trace_epoch = trace_now();
+	trace_thread_name("main");
+	atexit(trace_write);
+}
+
+#define TRACE_INIT() trace_init()
+#define TRACE_THREAD(name) trace_thread_name(name)
+#define TRACE_SCOPE(name) trace_span trace_scope __attribute__((cleanup(trace_end))) = trace_begin(name)
+#define TRACE_BEGIN(span, name) trace_span span = trace_begin(name)
+#define TRACE_END(span) trace_end(&span)
+#else
+#define TRACE_INIT() ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_BEGIN(span, name) ((void)0)
+#define TRACE_END(span) ((void)0)
+#endif
+
+void build_keymap() {
+	memset(keymap, 0, sizeof(keymap));
+	for (int i = KEYBIND_COUNT - 1; i >= 0; i--) {
+		keymap[(unsigned char)keybinds[i]] = (unsigned char)(i + 1);
+	}
+}
+
+int keybind_index(const char ch) {
+	return (int)keymap[(unsigned char)ch] - 1;
+}
+
+void load_keybinds(const char* filepath) {
+	FILE* config = fopen(filepath, "r");
+	if (config != NULL) {
+		char line[128];
+		int line_number = 0;
+		while (fgets(line, sizeof(line), config) != NULL) {
+			line_number++;
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] == '\0' || line[0] == '#') {
+				continue;
+			}
+			char* value = strchr(line, '=');
+			if (value == NULL) {
+				fprintf(stderr, "%s:%d: expected name=key\n", filepath, line_number);
+				continue;
+			}
+			*value++ = '\0';
+
+			char key;
+			if (strcmp(value, "\\n") == 0 || strcmp(value, "enter") == 0) {
+				key = '\n';
+			} else if (strcmp(value, "space") == 0) {
+				key = ' ';
+			} else if (strlen(value) == 1) {
+				key = (char)tolower((unsigned char)value[0]);
+			} else {
+				fprintf(stderr, "%s:%d: key must be a single character\n", filepath, line_number);
+				continue;
+			}
+
+			int found = 0;
+			for (int i = 0; i < KEYBIND_COUNT; i++) {
+				if (strcmp(line, keybind_names[i]) == 0) {
+					keybinds[i] = key;
+					found = 1;
+					break;
+				}
+			}
+			if (!found) {
+				fprintf(stderr, "%s:%d: unknown action '%s'\n", filepath, line_number, line);
+			}
+		}
+		fclose(config);
+	}
+	build_keymap();
+}
+
+int input_fill() {
+	if (input_pos < input_len) {
+		return 1;
+	}
+	TRACE_BEGIN(read_span, "input read");
+	const ssize_t bytes_read = read(STDIN_FILENO, input_buffer, sizeof(input_buffer));
+	if (bytes_read <= 0) {
+		return 0;    // Empty polls are not traced, the loop spins on them
+	}
+	TRACE_END(read_span);
+	input_len = (int)bytes_read;
+	input_pos = 0;
+	return 1;
+}
+
+int read_byte() {
+	if (!input_fill()) {
+		return EOF;
+	}
+	return input_buffer[input_pos++];
+}
+
+long long monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// When the outstanding cursor position report was requested, 0 when none is.
+// Set by whichever thread renders, cleared by the input loop.
+long long probe_sent_ns = 0;
+
+void probe_answered() {
+	__atomic_store_n(&probe_sent_ns, 0, __ATOMIC_RELEASE);
+}
+
+// Decodes one key from the input buffer, turning arrow key escape
+// sequences into the matching movement keybind
+int read_key() {
+	enum { KEY_GROUND, KEY_ESCAPE, KEY_SEQUENCE } state = KEY_GROUND;
+	for (;;) {
+		if (state != KEY_GROUND && input_pos >= input_len) {
+			// The rest of a sequence can trail behind in a later read, give it a moment.
+			// Polled even when stdin blocks, so a lone escape at a prompt still returns.
+			struct pollfd in = { .fd = STDIN_FILENO, .events = POLLIN };
+			if (poll(&in, 1, ESCAPE_DELAY_MS) <= 0 || !input_fill()) {
+				return (state == KEY_ESCAPE) ? 27 : EOF;    // Lone escape, or a sequence cut short
+			}
+		}
+		const int ch = read_byte();
+		if (ch == EOF) {
+			return EOF;
+		}
+		switch (state) {
+		case KEY_GROUND:
+			if (ch != 27) {
+				return ch;
+			}
+			state = KEY_ESCAPE;
+			break;
+		case KEY_ESCAPE:
+			if (ch == '[' || ch == 'O') {
+				state = KEY_SEQUENCE;
+				break;
+			}
+			input_pos--;
+			return 27;
+		case KEY_SEQUENCE:
+			if (ch < 0x40 || ch > 0x7E) {
+				break;    // Parameter and intermediate bytes
+			}
+			switch (ch) {
+			case 'A': return keybinds[0];
+			case 'D': return keybinds[1];
+			case 'B': return keybinds[2];
+			case 'C': return keybinds[3];
+			case 'R':
+				probe_answered();    // Cursor position report, see output_congested
+				state = KEY_GROUND;
+				break;
+			default:
+				state = KEY_GROUND;    // Unhandled sequence, drop it
+				break;
+			}
+			break;
+		}
+	}
+}
 
 Move get_move(const char input) {
-    const char* found_char = strchr(keybinds, input);
-    if (found_char != NULL) {
-	    const int index =  (int)(found_char - keybinds);
-	    switch (index) {
-	        case 0: return (Move){ 0, -1, 1 }; // Up
-        	case 2: return (Move){ 0,  1, 3 }; // Down
-        	case 1: return (Move){ -1, 0, 2 }; // Left
-        	case 3: return (Move){ 1,  0, 4 }; // Right
-        	default: return (Move){ 0,  0, 0 };
-	    }
-    } else {
-	    return (Move){ 0,  0, 0 };
+	switch (keybind_index(input)) {
+	case 0: return (Move){ 0, -1, 1 }; // Up
+	case 2: return (Move){ 0,  1, 3 }; // Down
+	case 1: return (Move){ -1, 0, 2 }; // Left
+	case 3: return (Move){ 1,  0, 4 }; // Right
+	default: return (Move){ 0,  0, 0 };
+	}
+}
+
+void mark_dirty(const int y, const int x) {
+	if (x < 0 || x >= COLS || y < 0 || y >= ROWS || composite_dirty[y][x]) {
+		return;
+	}
+	composite_dirty[y][x] = 1;
+	dirty_cells[dirty_count++] = y * COLS + x;
+}
+
+void set_layer_cell(const int layer, const int y, const int x, const char ch) {
+	if (layers[layer][y][x] != ch) {
+		layers[layer][y][x] = ch;
+		mark_dirty(y, x);
+	}
+}
+
+void invalidate_composite() {
+	for (int i = 0; i < ROWS; i++) {
+		for (int j = 0; j < COLS; j++) {
+			mark_dirty(i, j);
+		}
+	}
+}
+
+char compose_cell(const int y, const int x) {
+	char cell = (layers[LAYER_PERSIST][y][x] != '.') ? layers[LAYER_PERSIST][y][x] : layers[LAYER_BASE][y][x];
+	if (cell != '#' && cell != '=' && cell != '_' && cell != ' ' && cell != 'P') {
+		cell = '.';
+	}
+	const char entity_cell = layers[LAYER_ENTITY][y][x];
+	if (entity_cell == '%') {
+		return '%';
+	}
+	if (entity_cell != '.' && cell == '.') {
+		cell = entity_cell;
+	}
+	if (x == playerX && y == playerY && cell != '_' && cell != ' ' && cell != 'P') {
+		cell = '@';
+	}
+	return cell;
+}
+
+void mark_render(const int y, const int x) {
+	if (render_pending[y][x]) {
+		return;
+	}
+	render_pending[y][x] = 1;
+	render_cells[render_count++] = y * COLS + x;
+}
+
+void clear_render_list() {
+	for (int i = 0; i < render_count; i++) {
+		render_pending[render_cells[i] / COLS][render_cells[i] % COLS] = 0;
+	}
+	render_count = 0;
+}
+
+// Forces the next frame to be a full repaint
+void invalidate_screen() {
+	screen_valid = 0;
+	for (int i = 0; i < ROWS; i++) {
+		for (int j = 0; j < COLS; j++) {
+			mark_render(i, j);
+		}
+	}
+}
+
+int travel_passable(const char cell) {
+	return cell != '#' && cell != '_' && cell != ' ' && cell != '%' && cell != 'P';
+}
+
+void travel_push(const int y, const int x) {
+	if (!travel_queued[y][x]) {
+		travel_queued[y][x] = 1;
+		travel_queue[travel_tail] = y * COLS + x;
+		travel_tail = (travel_tail + 1) % TRAVEL_QUEUE_SIZE;
+	}
+}
+
+// Label-correcting BFS, lowers distances outward from whatever was queued
+void travel_relax() {
+	while (travel_head != travel_tail) {
+		const int y = travel_queue[travel_head] / COLS;
+		const int x = travel_queue[travel_head] % COLS;
+		travel_head = (travel_head + 1) % TRAVEL_QUEUE_SIZE;
+		travel_queued[y][x] = 0;
+		for (int d = 0; d < 4; d++) {
+			const int ny = y + travel_dirs[d][1];
+			const int nx = x + travel_dirs[d][0];
+			if (nx >= 0 && nx < COLS && ny >= 0 && ny < ROWS && travel_passable(game_state[ny][nx]) && travel_distance[ny][nx] > travel_distance[y][x] + 1) {
+				travel_distance[ny][nx] = travel_distance[y][x] + 1;
+				travel_push(ny, nx);
+			}
+		}
+	}
+}
+
+void build_travel_field(const int x, const int y) {
+	TRACE_SCOPE("build_travel_field");
+	for (int i = 0; i < ROWS; i++) {
+		for (int j = 0; j < COLS; j++) {
+			travel_distance[i][j] = TRAVEL_UNREACHED;
+		}
+	}
+	travel_targetX = x;
+	travel_targetY = y;
+	travel_distance[y][x] = 0;
+	travel_push(y, x);
+	travel_relax();
+}
+
+// Repairs the cached field around one cell whose passability flipped
+void travel_cell_changed(const int y, const int x) {
+	if (y == travel_targetY && x == travel_targetX) {
+		travel_targetX = -1;    // Rebuilt on the next travel
+		return;
+	}
+	if (travel_passable(game_state[y][x])) {
+		// Opening a cell can only shorten paths
+		for (int d = 0; d < 4; d++) {
+			const int ny = y + travel_dirs[d][1];
+			const int nx = x + travel_dirs[d][0];
+			if (nx >= 0 && nx < COLS && ny >= 0 && ny < ROWS && travel_distance[ny][nx] + 1 < travel_distance[y][x]) {
+				travel_distance[y][x] = travel_distance[ny][nx] + 1;
+			}
+		}
+		if (travel_distance[y][x] < TRAVEL_UNREACHED) {
+			travel_push(y, x);
+			travel_relax();
+		}
+		return;
+	}
+
+	// Closing a cell drops every distance that may have routed through it,
+	// then refills that region from its edge
+	int cleared[ROWS * COLS];
+	int cleared_count = 0;
+	int depth[ROWS * COLS];
+	if (travel_distance[y][x] == TRAVEL_UNREACHED) {
+		return;
+	}
+	depth[0] = travel_distance[y][x];
+	cleared[cleared_count++] = y * COLS + x;
+	travel_distance[y][x] = TRAVEL_UNREACHED;
+	for (int i = 0; i < cleared_count; i++) {
+		const int cy = cleared[i] / COLS;
+		const int cx = cleared[i] % COLS;
+		for (int d = 0; d < 4; d++) {
+			const int ny = cy + travel_dirs[d][1];
+			const int nx = cx + travel_dirs[d][0];
+			if (nx >= 0 && nx < COLS && ny >= 0 && ny < ROWS && travel_distance[ny][nx] == depth[i] + 1) {
+				depth[cleared_count] = travel_distance[ny][nx];
+				cleared[cleared_count++] = ny * COLS + nx;
+				travel_distance[ny][nx] = TRAVEL_UNREACHED;
+			}
+		}
+	}
+	for (int i = 1; i < cleared_count; i++) {
+		const int cy = cleared[i] / COLS;
+		const int cx = cleared[i] % COLS;
+		if (!travel_passable(game_state[cy][cx])) {
+			continue;
+		}
+		for (int d = 0; d < 4; d++) {
+			const int ny = cy + travel_dirs[d][1];
+			const int nx = cx + travel_dirs[d][0];
+			if (nx >= 0 && nx < COLS && ny >= 0 && ny < ROWS && travel_distance[ny][nx] + 1 < travel_distance[cy][cx]) {
+				travel_distance[cy][cx] = travel_distance[ny][nx] + 1;
+			}
+		}
+		if (travel_distance[cy][cx] < TRAVEL_UNREACHED) {
+			travel_push(cy, cx);
+		}
+	}
+	travel_relax();
+}
+
+// Recomposites the dirty cells, returns how many changed
+int flush_composite() {
+	if (playerX != composed_playerX || playerY != composed_playerY) {
+		mark_dirty(composed_playerY, composed_playerX);
+		mark_dirty(playerY, playerX);
+		composed_playerX = playerX;
+		composed_playerY = playerY;
+		fog_stale = 1;
+	}
+	int changed = 0;
+	for (int d = 0; d < dirty_count; d++) {
+		const int y = dirty_cells[d] / COLS;
+		const int x = dirty_cells[d] % COLS;
+		composite_dirty[y][x] = 0;
+		const char cell = compose_cell(y, x);
+		if (game_state[y][x] != cell) {
+			if ((game_state[y][x] == '#') != (cell == '#') && abs(y - playerY) <= FOG_RADIUS && abs(x - playerX) <= FOG_RADIUS) {
+				fog_stale = 1;
+			}
+			const int was_passable = travel_passable(game_state[y][x]);
+			game_state[y][x] = cell;
+			changed++;
+			if (travel_targetX >= 0 && was_passable != travel_passable(cell)) {
+				travel_cell_changed(y, x);
+			}
+			// Hidden cells keep showing what was last seen there
+			if (!fog_enabled || visible[y][x]) {
+				remembered[y][x] = cell;
+				mark_render(y, x);
+			}
+		}
+	}
+	dirty_count = 0;
+	return changed;
+}
+
+void reset_fog() {
+	memset(visible, 0, sizeof(visible));
+	memset(seen, 0, sizeof(seen));
+	visible_count = 0;
+	fog_stale = 1;
+	invalidate_screen();
+}
+
+int fog_blocks(const int y, const int x) {
+	return x < 0 || x >= COLS || y < 0 || y >= ROWS || game_state[y][x] == '#';
+}
+
+void fog_light(const int y, const int x) {
+	if (x < 0 || x >= COLS || y < 0 || y >= ROWS || lit_generation[y][x] == fog_generation) {
+		return;
+	}
+	lit_generation[y][x] = fog_generation;
+	lit_cells[lit_count++] = y * COLS + x;
+}
+
+// Recursive shadowcasting over one octant, slopes run from start down to end
+void cast_light(const int row, float start, const float end, const int* octant) {
+	if (start < end) {
+		return;
+	}
+	float new_start = 0.0f;
+	for (int j = row; j <= FOG_RADIUS; j++) {
+		const int dy = -j;
+		int blocked = 0;
+		for (int dx = -j; dx <= 0; dx++) {
+			const int x = playerX + dx * octant[0] + dy * octant[1];
+			const int y = playerY + dx * octant[2] + dy * octant[3];
+			const float left_slope = (dx - 0.5f) / (dy + 0.5f);
+			const float right_slope = (dx + 0.5f) / (dy - 0.5f);
+			if (start < right_slope) {
+				continue;
+			}
+			if (end > left_slope) {
+				break;
+			}
+			if (dx * dx + dy * dy <= FOG_RADIUS * FOG_RADIUS) {
+				fog_light(y, x);
+			}
+			if (blocked) {
+				if (fog_blocks(y, x)) {
+					new_start = right_slope;
+					continue;
+				}
+				blocked = 0;
+				start = new_start;
+			} else if (fog_blocks(y, x) && j < FOG_RADIUS) {
+				blocked = 1;
+				cast_light(j + 1, start, left_slope, octant);
+				new_start = right_slope;
+			}
+		}
+		if (blocked) {
+			break;
+		}
+	}
+}
+
+// Recasts only when the player moved or a wall in range changed, and queues
+// just the cells whose visibility flipped
+void update_fog() {
+	if (!fog_enabled || !fog_stale) {
+		return;
+	}
+	TRACE_SCOPE("update_fog");
+	fog_stale = 0;
+	fog_generation++;
+	lit_count = 0;
+	fog_light(playerY, playerX);
+	for (int octant = 0; octant < 8; octant++) {
+		cast_light(1, 1.0f, 0.0f, fog_octants[octant]);
+	}
+
+	for (int i = 0; i < visible_count; i++) {
+		const int y = visible_cells[i] / COLS;
+		const int x = visible_cells[i] % COLS;
+		if (lit_generation[y][x] != fog_generation) {
+			visible[y][x] = 0;
+			mark_render(y, x);
+		}
+	}
+	for (int i = 0; i < lit_count; i++) {
+		const int y = lit_cells[i] / COLS;
+		const int x = lit_cells[i] % COLS;
+		if (!visible[y][x]) {
+			visible[y][x] = 1;
+			seen[y][x] = 1;
+			remembered[y][x] = game_state[y][x];
+			mark_render(y, x);
+		}
 	}
+	memcpy(visible_cells, lit_cells, lit_count * sizeof(int));
+	visible_count = lit_count;
+}
+
+void parse_layer(const char* text, const int layer) {
+	for (int i = 0; i < ROWS; i++) {
+		for (int j = 0; j < COLS; j++) {
+			layers[layer][i][j] = '.';
+		}
+	}
+	int x = 0, y = 0;
+	for (int i = 0; text[i] != '\0'; i++) {
+		if (text[i] == '\n') {
+			y++;
+			x = 0;
+			continue;
+		}
+		if (y >= ROWS) break;
+		if (x < COLS) {
+			layers[layer][y][x] = text[i];
+		}
+		x++;
+	}
+}
+
+void build_layer_text(char* text, const int layer, const int overlay) {
+	int index = 0;
+	for (int r = 0; r < ROWS; r++) {
+		for (int c = 0; c < COLS; c++) {
+			text[index++] = (overlay >= 0 && layers[overlay][r][c] != '.') ? layers[overlay][r][c] : layers[layer][r][c];
+		}
+		text[index++] = '\n';
+	}
+	text[index] = '\0';
+}
+
+int is_entity_layer_glyph(const char glyph) {
+	return glyph == '@' || glyph == '%' || glyph == '<' || glyph == '>' || glyph == '^' || glyph == 'v';
+}
+
+// The editor's Regular view shows the map section as it is saved, entities over the base
+char editor_glyph(const int layer, const int y, const int x) {
+	if (layer == LAYER_BASE && layers[LAYER_ENTITY][y][x] != '.') {
+		return layers[LAYER_ENTITY][y][x];
+	}
+	return layers[layer][y][x];
+}
+
+// An edit on the Regular view replaces whatever the map section held there, entity included
+void set_editor_glyph(const int layer, const int y, const int x, const char ch) {
+	layers[layer][y][x] = ch;
+	if (layer == LAYER_BASE) {
+		layers[LAYER_ENTITY][y][x] = '.';
+	}
+}
+
+// The map section holds base terrain and entities together, split them apart
+void parse_map_layers() {
+	parse_layer(game_map, LAYER_BASE);
+	parse_layer(persist_map, LAYER_PERSIST);
+	parse_layer(decal_map, LAYER_DECAL);
+	for (int i = 0; i < ROWS; i++) {
+		for (int j = 0; j < COLS; j++) {
+			layers[LAYER_ENTITY][i][j] = '.';
+			if (is_entity_layer_glyph(layers[LAYER_BASE][i][j])) {
+				layers[LAYER_ENTITY][i][j] = layers[LAYER_BASE][i][j];
+				layers[LAYER_BASE][i][j] = '.';
+			}
+		}
+	}
+	invalidate_composite();
 }
 
 void create_box(const int x, const int y) {
@@ -76,13 +857,21 @@ void create_box(const int x, const int y) {
 	new_box->x = x;
 	new_box->y = y;
 	new_box->id = box_count;
+	set_layer_cell(LAYER_ENTITY, y, x, '%');
 
 	boxes[box_count] = new_box;
 	box_count++;
 }
 
+// Replaces the message on a fixed row, so messages never pile up and scroll the frame
+void show_status(const int row, const char* text) {
+	printf("\x1B" "7\x1B[%d;1H\x1B[K%s\x1B" "8", row, text);
+	fflush(stdout);
+}
+
 void clear_screen() {
 	printf("\x1B[1;1H\x1B[2J");
+	screen_valid = 0;
 }
 
 char* get_user_input() {
@@ -97,7 +886,7 @@ char* get_user_input() {
 	size_t len = 0;
 	int ch;
 
-	while (!isblank((ch = getchar())) && ch != EOF && ch != '\n') {
+	while (!isblank((ch = read_byte())) && ch != EOF && ch != '\n') {
 		if (len + 1 >= size) {
 			size *= 2;
 			char* new_buffer = realloc(buffer, size);
@@ -119,90 +908,302 @@ char* get_user_input() {
 	return buffer;
 }
 
-void render_game() {
-	char buffer[ROWS * (COLS * 10) + 1];
-	int index = 0;
-	if (boxes != NULL) {
-		for (int c = 0; c < box_count; c++) {
-			if (boxes[c] != NULL) {
-				const int boxx = boxes[c]->x;
-				const int boxy = boxes[c]->y;
-				if (boxx > -1 && boxx < COLS && boxy > -1 && boxy < ROWS) {
-					game_state[boxes[c]->y][boxes[c]->x] = '%';
-				}
-			}
-		}
+typedef struct {
+	unsigned long sequence;        // Odd while the slot is being written
+	int length;
+	char frame[FRAME_BUFFER_SIZE];
+} broadcast_slot;
+
+// Single writer, any number of read-only spectators. Every frame is a full
+// repaint, so whichever slot a late joiner reads first is a keyframe.
+typedef struct {
+	unsigned int magic;
+	unsigned int rows;
+	unsigned int cols;
+	int active;
+	int pid;                       // Writer, checked when it stops without clearing active
+	unsigned long head;            // Number of the newest published frame
+	broadcast_slot slots[BROADCAST_SLOTS];
+} broadcast_ring;
+
+broadcast_ring* broadcast = NULL;
+
+void broadcast_close() {
+	if (broadcast != NULL) {
+		__atomic_store_n(&broadcast->active, 0, __ATOMIC_RELEASE);
+		munmap(broadcast, sizeof(broadcast_ring));
+		broadcast = NULL;
+		shm_unlink(BROADCAST_NAME);
 	}
+}
 
-	for (int i = 0; i < ROWS; i++) {
-		for (int j = 0; j < COLS; j++) {
-			switch(game_state[i][j]) {
-			case '_':
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[31m\x1B[21m");
-				buffer[index++] = game_state[i][j];
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[0m");
-				break;
-			case ' ':
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[32m\x1B[102m");
-				buffer[index++] = '#';
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[0m");
-				break;
-			case 'P':
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[38;5;93m");
-				buffer[index++] = game_state[i][j];
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[0m");
-				break;
-			case '@':
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[92m");
-				buffer[index++] = game_state[i][j];
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[0m");
-				break;
-			case '%':
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[93m");
-				buffer[index++] = game_state[i][j];
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[0m");
-				break;
-			case '=':
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[36m");
-				buffer[index++] = game_state[i][j];
-				index += snprintf(&buffer[index], sizeof(buffer) - index, "\x1B[0m");
-				break;
-			default:
-				buffer[index++] = game_state[i][j];
+int broadcast_open() {
+	shm_unlink(BROADCAST_NAME);    // Spectators of a stale session keep their old mapping
+	const int fd = shm_open(BROADCAST_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		perror("shm_open");
+		return 3;
+	}
+	if (ftruncate(fd, sizeof(broadcast_ring)) != 0) {
+		perror("ftruncate");
+		close(fd);
+		return 2;
+	}
+	void* mapping = mmap(NULL, sizeof(broadcast_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		perror("mmap");
+		return 2;
+	}
+	broadcast = (broadcast_ring*)mapping;
+	broadcast->rows = ROWS;
+	broadcast->cols = COLS;
+	broadcast->active = 1;
+	broadcast->pid = getpid();
+	__atomic_store_n(&broadcast->magic, BROADCAST_MAGIC, __ATOMIC_RELEASE);
+	atexit(broadcast_close);
+	return 0;
+}
+
+// Never waits on spectators, a slow reader just misses frames
+void broadcast_frame(const char* frame, const int length) {
+	if (broadcast == NULL) {
+		return;
+	}
+	const unsigned long number = broadcast->head + 1;
+	broadcast_slot* slot = &broadcast->slots[number % BROADCAST_SLOTS];
+	__atomic_store_n(&slot->sequence, number * 2 - 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(slot->frame, frame, length);
+	slot->length = length;
+	__atomic_store_n(&slot->sequence, number * 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&broadcast->head, number, __ATOMIC_RELEASE);
+}
+
+int handle_spectate() {
+	const int fd = shm_open(BROADCAST_NAME, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "No broadcast running.\n");
+		return EXIT_FAILURE;
+	}
+	void* mapping = mmap(NULL, sizeof(broadcast_ring), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+	const broadcast_ring* ring = (const broadcast_ring*)mapping;
+	if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != BROADCAST_MAGIC || ring->rows != ROWS || ring->cols != COLS) {
+		fprintf(stderr, "Broadcast is from an incompatible build.\n");
+		munmap(mapping, sizeof(broadcast_ring));
+		return EXIT_FAILURE;
+	}
+
+	char frame[FRAME_BUFFER_SIZE];
+	unsigned long shown = 0;
+	printf("\x1B[?25l");
+	while (__atomic_load_n(&ring->active, __ATOMIC_ACQUIRE)) {
+		const unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head == shown) {
+			// A killed or crashed game never clears active
+			if (kill(ring->pid, 0) != 0 && errno == ESRCH) {
 				break;
 			}
+			usleep(SPECTATE_POLL_US);
+			continue;
+		}
+		// Always jump to the newest frame, skipping any we fell behind on
+		const broadcast_slot* slot = &ring->slots[head % BROADCAST_SLOTS];
+		const unsigned long before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (before != head * 2) {
+			continue;
+		}
+		int length = slot->length;
+		if (length < 0 || length >= FRAME_BUFFER_SIZE) {
+			continue;
 		}
-		buffer[index++] = '\n';
+		memcpy(frame, slot->frame, length);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != before) {
+			continue;    // Overwritten while copying
+		}
+		frame[length] = '\0';
+		shown = head;
+		clear_screen();
+		printf("%s\nSpectating    Frame %lu\n", frame, head);
+		fflush(stdout);
 	}
-	buffer[index] = '\0';
+	printf("\nBroadcast ended.\n\x1B[?25h");
+	munmap(mapping, sizeof(broadcast_ring));
+	return EXIT_SUCCESS;
+}
 
-	clear_screen();
-	printf("%s", buffer);
-	printf("\nWASD - Move    R - Restart    Q - Quit to menu    %s\n",collision ? "" : "NOCLIP");
+// Appends the styled glyph of one cell, at most CELL_RENDER_SIZE bytes
+int render_cell(char* buffer, const size_t size, int index, const int y, const int x) {
+	if (travel_selecting && y == travel_cursorY && x == travel_cursorX) {
+		buffer[index++] = '!';
+		return index;
+	}
+	if (fog_enabled && !visible[y][x]) {
+		if (!seen[y][x]) {
+			buffer[index++] = ' ';
+		} else {
+			index += snprintf(&buffer[index], size - index, "\x1B[2m%c\x1B[0m", remembered[y][x] == ' ' ? '#' : remembered[y][x]);
+		}
+		return index;
+	}
+	const char cell = (game_state[y][x] == '.' && layers[LAYER_DECAL][y][x] != '.') ? layers[LAYER_DECAL][y][x] : game_state[y][x];
+	switch(cell) {
+	case '_':
+		index += snprintf(&buffer[index], size - index, "\x1B[31m\x1B[21m");
+		buffer[index++] = cell;
+		index += snprintf(&buffer[index], size - index, "\x1B[0m");
+		break;
+	case ' ':
+		index += snprintf(&buffer[index], size - index, "\x1B[32m\x1B[102m");
+		buffer[index++] = '#';
+		index += snprintf(&buffer[index], size - index, "\x1B[0m");
+		break;
+	case 'P':
+		index += snprintf(&buffer[index], size - index, "\x1B[38;5;93m");
+		buffer[index++] = cell;
+		index += snprintf(&buffer[index], size - index, "\x1B[0m");
+		break;
+	case '@':
+		index += snprintf(&buffer[index], size - index, "\x1B[92m");
+		buffer[index++] = cell;
+		index += snprintf(&buffer[index], size - index, "\x1B[0m");
+		break;
+	case '%':
+		index += snprintf(&buffer[index], size - index, "\x1B[93m");
+		buffer[index++] = cell;
+		index += snprintf(&buffer[index], size - index, "\x1B[0m");
+		break;
+	case '=':
+		index += snprintf(&buffer[index], size - index, "\x1B[36m");
+		buffer[index++] = cell;
+		index += snprintf(&buffer[index], size - index, "\x1B[0m");
+		break;
+	default:
+		buffer[index++] = cell;
+		break;
+	}
+	return index;
 }
 
-int compare_2d_arrays(char arr1[ROWS][COLS], char arr2[ROWS][COLS]) {
-	for (int i = 0; i < ROWS; i++) {
-		for (int j = 0; j < COLS; j++) {
-			if (arr1[i][j] != arr2[i][j]) {
-				return 0;
-			}
+// Flow control on end-to-end latency. A frame sent while no report is
+// pending ends with ESC[6n, and the terminal only answers once it has drawn
+// everything before it, however deep the pty and network buffers are.
+// Until the answer arrives at most OUTPUT_WINDOW bytes go out, held frames
+// accumulate in the render list.
+int output_congested() {
+	const long long now = monotonic_ns();
+	if (now < output_retry_ns) {
+		return 1;
+	}
+	const long long sent = __atomic_load_n(&probe_sent_ns, __ATOMIC_ACQUIRE);
+	if (sent != 0 && now - sent > PROBE_TIMEOUT_NS) {
+		probe_answered();    // Lost, or a terminal that does not report
+	} else if (sent != 0) {
+		return bytes_in_flight > OUTPUT_WINDOW;
+	}
+	bytes_in_flight = 0;
+	return 0;
+}
+
+// Writes a frame straight to the terminal. The caller holds the game lock and
+// stdin shares the tty, so a full buffer is never waited on: the frame is
+// dropped and repainted in full after a back-off. Returns 0 if it all went out.
+int write_frame(const char* data, const int length) {
+	TRACE_SCOPE("write_frame");
+	fflush(stdout);
+	int written = 0;
+	while (written < length) {
+		const ssize_t bytes = write(STDOUT_FILENO, data + written, length - written);
+		if (bytes >= 0) {
+			written += bytes;
+			continue;
 		}
+		if (errno == EINTR) {
+			continue;
+		}
+		output_retry_ns = monotonic_ns() + OUTPUT_RETRY_NS;
+		invalidate_screen();
+		frame_pending = 1;
+		break;
 	}
-	return 1;
+	bytes_in_flight += written;
+	return (written == length) ? 0 : 1;
 }
 
-void copy_2d_array(char dest[ROWS][COLS], char src[ROWS][COLS]) {
-	for (int i = 0; i < ROWS; i++) {
-		for (int j = 0; j < COLS; j++) {
-			dest[i][j] = src[i][j];
+// Presents the newest state, skipping frames while the terminal lags behind
+// and repainting only the queued cells when that is cheaper than a full frame
+void render_game() {
+	TRACE_SCOPE("render_game");
+	char buffer[FRAME_BUFFER_SIZE];
+	char output[FRAME_BUFFER_SIZE + 256];
+	int index = 0;
+	int length = 0;
+
+	if (broadcast != NULL) {
+		for (int i = 0; i < ROWS; i++) {
+			for (int j = 0; j < COLS; j++) {
+				index = render_cell(buffer, sizeof(buffer), index, i, j);
+			}
+			buffer[index++] = '\n';
 		}
+		buffer[index] = '\0';
+		broadcast_frame(buffer, index);
+	}
+
+	if (output_congested()) {
+		frame_pending = 1;
+		return;
+	}
+	frame_pending = 0;
+
+	if (screen_valid) {
+		// Save and restore the cursor so text printed under the frame stays put
+		length = snprintf(output, sizeof(output), "\x1B" "7");
+		for (int i = 0; i < render_count && length < full_frame_size; i++) {
+			const int y = render_cells[i] / COLS;
+			const int x = render_cells[i] % COLS;
+			length += snprintf(&output[length], sizeof(output) - length, "\x1B[%d;%dH", y + 1, x + 1);
+			length = render_cell(output, sizeof(output), length, y, x);
+		}
+		length += snprintf(&output[length], sizeof(output) - length, "\x1B" "8");
+	}
+	if (!screen_valid || length >= full_frame_size) {
+		if (broadcast == NULL) {
+			index = 0;
+			for (int i = 0; i < ROWS; i++) {
+				for (int j = 0; j < COLS; j++) {
+					index = render_cell(buffer, sizeof(buffer), index, i, j);
+				}
+				buffer[index++] = '\n';
+			}
+			buffer[index] = '\0';
+		}
+		length = snprintf(output, sizeof(output), "\x1B[1;1H\x1B[2J%s\nWASD - Move    R - Restart    Q - Quit to menu    O - Fog    T - Travel\nK - Quick save    L - Quick load    %s\n", buffer, collision ? "" : "NOCLIP");
+		full_frame_size = length;
+		screen_valid = 1;
+	}
+	clear_render_list();
+	const int probe = isatty(STDOUT_FILENO) && __atomic_load_n(&probe_sent_ns, __ATOMIC_ACQUIRE) == 0;
+	if (probe) {
+		length += snprintf(&output[length], sizeof(output) - length, "\x1B[6n");
+		// Stamped before writing, the input loop may see the answer before this returns
+		__atomic_store_n(&probe_sent_ns, monotonic_ns(), __ATOMIC_RELEASE);
+	}
+	if (write_frame(output, length) != 0 && probe) {
+		probe_answered();
 	}
 }
 
 void remove_box(const int x, const int y) {
 	for (int i = 0; i < box_count; i++) {
 		if (boxes[i]->x == x && boxes[i]->y == y) {
+			set_layer_cell(LAYER_ENTITY, y, x, '.');
 			free(boxes[i]);
 			if (i != box_count - 1) {
 				boxes[i] = boxes[box_count - 1];
@@ -232,97 +1233,141 @@ void reset_boxes() {
 	box_count = 0;
 }
 
-void load_initial_game_state() {
-	for (int i = 0; i < ROWS; i++) {
-		for (int j = 0; j < COLS; j++) {
-			game_state[i][j] = '.';
-			persist_array[i][j] = '.';
-		}
+typedef struct entity {
+	struct entity* next;
+	struct entity* prev;
+	unsigned long expires;
+	int period;
+	int x;
+	int y;
+	int dx;
+	int dy;
+	char kind;
+} entity;
+
+entity entities[ROWS * COLS];
+int entity_count = 0;
+entity* wheel[WHEEL_LEVELS][WHEEL_SIZE];
+unsigned long tick_now = 0;
+volatile int timer_count = 0;
+
+void wheel_insert(entity* e) {
+	const unsigned long delta = e->expires - tick_now;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= (1UL << (WHEEL_BITS * (level + 1)))) {
+		level++;
 	}
+	const int slot = (int)((e->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
 
-	reset_boxes();
+	e->prev = NULL;
+	e->next = wheel[level][slot];
+	if (e->next != NULL) {
+		e->next->prev = e;
+	}
+	wheel[level][slot] = e;
+}
 
-	int x = 0, y = 0;
-	for (int i = 0; game_map[i] != '\0'; i++) {
-		if (game_map[i] == '\n') {
-			y++;
-			x = 0;
-			continue;
-		}
-		if (y >= ROWS) break;
-		if (x < COLS) {
-			game_state[y][x] = game_map[i];
+void schedule_entity(entity* e, const int delay) {
+	e->expires = tick_now + (delay > 0 ? delay : 1);
+	wheel_insert(e);
+	timer_count++;
+}
+
+void reset_entities() {
+	memset(wheel, 0, sizeof(wheel));
+	entity_count = 0;
+	tick_now = 0;
+	timer_count = 0;
+}
 
-			if (game_map[i] == '@') {
+void register_entity(const char glyph, const int x, const int y) {
+	entity* e = &entities[entity_count++];
+	memset(e, 0, sizeof(*e));
+	e->kind = glyph;
+	e->x = x;
+	e->y = y;
+	switch (glyph) {
+	case '~':
+		e->period = GATE_PERIOD;
+		break;
+	case '<': e->dx = -1; e->period = PATROL_PERIOD; break;
+	case '>': e->dx =  1; e->period = PATROL_PERIOD; break;
+	case '^': e->dy = -1; e->period = PATROL_PERIOD; break;
+	case 'v': e->dy =  1; e->period = PATROL_PERIOD; break;
+	}
+	schedule_entity(e, e->period);
+}
+
+int is_timed_glyph(const char glyph) {
+	return glyph == '~' || glyph == '<' || glyph == '>' || glyph == '^' || glyph == 'v';
+}
+
+void load_initial_game_state() {
+	reset_boxes();
+	reset_entities();
+	parse_map_layers();
+	reset_fog();
+	travel_selecting = 0;
+	travel_targetX = -1;
+
+	for (int y = 0; y < ROWS; y++) {
+		for (int x = 0; x < COLS; x++) {
+			const char entity_cell = layers[LAYER_ENTITY][y][x];
+			if (entity_cell == '@') {
 				playerX = x;
 				playerY = y;
+				layers[LAYER_ENTITY][y][x] = '.';
 			}
-			if (game_map[i] == '%') {
+			if (entity_cell == '%') {
+				layers[LAYER_ENTITY][y][x] = '.';
 				create_box(x, y);
 			}
-		}
-		x++;
-	}
-	x = 0;
-	y = 0;
-	for (int a = 0; persist_map[a] != '\0'; a++) {
-		if (persist_map[a] == '\n') {
-			y++;
-			x = 0;
-			continue;
-		}
-		if (y >= ROWS) break;
-		if (x < COLS) {
-			persist_array[y][x] = persist_map[a];
-		}
-		x++;
-	}
-	for (int c = 0; c < ROWS; c++) {
-		for (int v = 0; v < COLS; v++) {
-			if (persist_array[c][v] != '.') {
-				game_state[c][v] = persist_array[c][v];
+			if (is_timed_glyph(entity_cell)) {
+				register_entity(entity_cell, x, y);
+				layers[LAYER_ENTITY][y][x] = '_';
+			}
+			if (layers[LAYER_BASE][y][x] == '~') {
+				register_entity('~', x, y);
+				layers[LAYER_BASE][y][x] = '=';
 			}
 		}
 	}
+	flush_composite();
+	pthread_cond_signal(&tick_cond);
 }
 
-void* update_game_state(void* arg) {
-	const int init = *(int*)arg;
-
-	if (init) {
-		load_initial_game_state();
-		render_game();
+// Applies a player move to the layers and composite without presenting it
+void settle_player() {
+	if (collision) {
+		playerX = (playerX < 0) ? 0 : (playerX > COLS - 1) ? COLS - 1 : playerX;
+		playerY = (playerY < 0) ? 0 : (playerY > ROWS - 1) ? ROWS - 1 : playerY;
 	} else {
-		char prev_game_state[ROWS][COLS];
-		copy_2d_array(prev_game_state, (char (*)[COLS])game_state);
+		playerX = (playerX + COLS) % COLS;
+		playerY = (playerY + ROWS) % ROWS;
+	}
 
-		if (collision) {
-			playerX = (playerX < 0) ? 0 : (playerX > COLS - 1) ? COLS - 1 : playerX;
-			playerY = (playerY < 0) ? 0 : (playerY > ROWS - 1) ? ROWS - 1 : playerY;
-		} else {
-			playerX = (playerX + COLS) % COLS;
-			playerY = (playerY + ROWS) % ROWS;
-		}
-		for (int i = 0; i < ROWS; i++) {
-			for (int j = 0; j < COLS; j++) {
-				if (persist_array[i][j] != '.') {
-					game_state[i][j] = persist_array[i][j];
-				}
-				if (game_state[i][j] == '_' || game_state[i][j] == ' ' || game_state[i][j] == 'P') {
-					continue;
-				}
-				if (playerX == j && playerY == i) {
-					game_state[i][j] = '@';
-					continue;
-				}
-				if (game_state[i][j] == '#' || game_state[i][j] == '=') {
-					continue;
-				}
-				game_state[i][j] = '.';
-			}
-		}
+	// The player wipes base terrain it stands on, only the persist layer survives
+	const char under = layers[LAYER_BASE][playerY][playerX];
+	if (under != '.' && under != '_' && under != ' ' && under != 'P'
+			&& layers[LAYER_PERSIST][playerY][playerX] == '.' && layers[LAYER_ENTITY][playerY][playerX] != '_') {
+		set_layer_cell(LAYER_BASE, playerY, playerX, '.');
+	}
+
+	flush_composite();
+	update_fog();
+}
+
+void* update_game_state(void* arg) {
+	TRACE_SCOPE("update_game_state");
+	const int init = *(int*)arg;
 
-		if (!compare_2d_arrays(prev_game_state, (char (*)[COLS])game_state)) {
+	if (init) {
+		load_initial_game_state();
+		update_fog();
+		render_game();
+	} else {
+		settle_player();
+		if (render_count > 0) {
 			render_game();
 		}
 	}
@@ -377,16 +1422,23 @@ int box_check(const int x, const int y, const int direction) {
 	if (new_x >= 0 && new_x < COLS && new_y >= 0 && new_y < ROWS) {
 		const char cell = game_state[new_y][new_x];
 		if (cell == '.' || cell == '_' || cell == ' ') {
+			set_layer_cell(LAYER_ENTITY, b->y, b->x, '.');
+			set_layer_cell(LAYER_ENTITY, new_y, new_x, '%');
 			b->x = new_x;
 			b->y = new_y;
 		} else if (cell == '=') {
 			return 0;
 		}
 	}
-	char cell = game_state[b->y][b->x];
+	const int boxX = b->x;
+	const int boxY = b->y;
+	const char cell = game_state[boxY][boxX];
 	if (cell == '_' || cell == ' ') {
-		game_state[b->y][b->x] = (cell == '_') ? '.' : cell;
-		remove_box(b->x, b->y);
+		remove_box(boxX, boxY);
+		if (cell == '_') {
+			// Fills the hazard, whichever layer it came from
+			set_layer_cell(layers[LAYER_ENTITY][boxY][boxX] == '_' ? LAYER_ENTITY : LAYER_BASE, boxY, boxX, '.');
+		}
 	}
 
 	return 1;
@@ -406,41 +1458,205 @@ int check_collision(int x, int y) {
 	return 1;
 }
 
-void save_editor() {
-	int index = 0;
-	char buffer[ROWS * (COLS + 1) + 1];
-	for (int r = 0; r < ROWS; r++) {
-		for (int c = 0; c < COLS; c++) {
-			buffer[index] = game_state[r][c];
-			index++;
+// Walks the shortest safe path to the cell in one go, the caller presents
+// only the final frame. Returns 1 when there is no safe path.
+int travel_to(const int x, const int y) {
+	TRACE_SCOPE("travel_to");
+	if (!travel_passable(game_state[y][x]) && game_state[y][x] != 'P') {
+		return 1;
+	}
+	if (x != travel_targetX || y != travel_targetY) {
+		build_travel_field(x, y);
+	}
+	while (playerX != x || playerY != y) {
+		const int here = travel_distance[playerY][playerX];
+		int moved = 0;
+		for (int d = 0; d < 4 && !moved && here < TRAVEL_UNREACHED; d++) {
+			const int nx = playerX + travel_dirs[d][0];
+			const int ny = playerY + travel_dirs[d][1];
+			if (nx >= 0 && nx < COLS && ny >= 0 && ny < ROWS && travel_distance[ny][nx] == here - 1 && check_collision(nx, ny)) {
+				playerX = nx;
+				playerY = ny;
+				settle_player();
+				moved = 1;
+			}
+		}
+		if (!moved) {
+			return 1;
 		}
-		buffer[index] = '\n';
-		index++;
 	}
-	buffer[index] = '\0';
-	strcpy(game_map, buffer);
+	return 0;
+}
 
-	int Pindex = 0;
-	char Pbuffer[ROWS * (COLS + 1) + 1];
-	for (int Pr = 0; Pr < ROWS; Pr++) {
-		for (int Pc = 0; Pc < COLS; Pc++) {
-			Pbuffer[Pindex] = persist_array[Pr][Pc];
-			Pindex++;
+// Cursor picking for the travel command, like the editor's '!'
+void travel_key(const char ch) {
+	mark_render(travel_cursorY, travel_cursorX);
+	const int index = keybind_index(ch);
+	if (index >= 0 && index <= 3) {
+		const Move move = get_move(ch);
+		travel_cursorX = (travel_cursorX + move.dx + COLS) % COLS;
+		travel_cursorY = (travel_cursorY + move.dy + ROWS) % ROWS;
+		mark_render(travel_cursorY, travel_cursorX);
+	} else if (ch == keybinds[6]) {
+		travel_selecting = 0;
+		if (travel_to(travel_cursorX, travel_cursorY) != 0) {
+			show_status(GAME_STATUS_ROW, "No safe path there.");
 		}
-		Pbuffer[Pindex] = '\n';
-		Pindex++;
+	} else if (ch == keybinds[17] || ch == keybinds[5]) {
+		travel_selecting = 0;
 	}
-	Pbuffer[Pindex] = '\0';
-	strcpy(persist_map, Pbuffer);
 }
 
-int load_map(const char *filepath) {
-	char filename[strlen(filepath) + 5];
-	snprintf(filename, sizeof(filename), "%s.map", filepath);
-	FILE* map_file = fopen(filename, "r");
-	if (!map_file) {
-		perror("fopen");
+int patrol_can_enter(const int x, const int y) {
+	if (x < 0 || x >= COLS || y < 0 || y >= ROWS || find_box(x, y) != NULL) {
+		return 0;
+	}
+	return game_state[y][x] == '.' || game_state[y][x] == '@';
+}
+
+// Returns 1 if the entity stays scheduled
+int step_entity(entity* e) {
+	if (e->kind == '~') {
+		set_layer_cell(LAYER_BASE, e->y, e->x, (layers[LAYER_BASE][e->y][e->x] == '=') ? '.' : '=');
+		return 1;
+	}
+
+	if (layers[LAYER_ENTITY][e->y][e->x] != '_') {
+		return 0;    // Filled in by a box
+	}
+	if (!patrol_can_enter(e->x + e->dx, e->y + e->dy)) {
+		e->dx = -e->dx;
+		e->dy = -e->dy;
+		if (!patrol_can_enter(e->x + e->dx, e->y + e->dy)) {
+			return 1;
+		}
+	}
+	set_layer_cell(LAYER_ENTITY, e->y, e->x, '.');
+	e->x += e->dx;
+	e->y += e->dy;
+	set_layer_cell(LAYER_ENTITY, e->y, e->x, '_');
+	if (e->x == playerX && e->y == playerY && collision) {
+		death = 1;
+	}
+	return 1;
+}
+
+void run_due_entities(entity* list) {
+	while (list != NULL) {
+		entity* e = list;
+		list = list->next;
+		timer_count--;
+		if (e->expires != tick_now) {
+			wheel_insert(e);
+			timer_count++;
+			continue;
+		}
+		if (step_entity(e)) {
+			schedule_entity(e, e->period);
+		} else {
+			e->period = 0;
+		}
+	}
+}
+
+void advance_tick() {
+	tick_now++;
+	for (int level = 1; level < WHEEL_LEVELS; level++) {
+		if (tick_now & ((1UL << (WHEEL_BITS * level)) - 1)) {
+			break;
+		}
+		const int slot = (int)((tick_now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
+		entity* list = wheel[level][slot];
+		wheel[level][slot] = NULL;
+		while (list != NULL) {
+			entity* e = list;
+			list = list->next;
+			wheel_insert(e);
+		}
+	}
+	const int slot = (int)(tick_now & (WHEEL_SIZE - 1));
+	entity* due = wheel[0][slot];
+	wheel[0][slot] = NULL;
+	run_due_entities(due);
+}
+
+void timespec_add_ns(struct timespec* ts, const long ns) {
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+void* tick_thread(void* arg) {
+	const int no_init = 0;
+	struct timespec next_tick;
+	TRACE_THREAD("tick");
+	clock_gettime(CLOCK_MONOTONIC, &next_tick);
+
+	pthread_mutex_lock(&game_state_mutex);
+	while (!tick_stop) {
+		if (timer_count == 0 || death || win_map) {
+			// Idle maps and end screens park the thread instead of ticking
+			pthread_cond_wait(&tick_cond, &game_state_mutex);
+			clock_gettime(CLOCK_MONOTONIC, &next_tick);
+			continue;
+		}
+		pthread_mutex_unlock(&game_state_mutex);
+		timespec_add_ns(&next_tick, TICK_NS);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL);
+		pthread_mutex_lock(&game_state_mutex);
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int ticks = 1;
+		while (ticks < TICK_MAX_CATCHUP
+				&& (now.tv_sec - next_tick.tv_sec) * 1000000000L + (now.tv_nsec - next_tick.tv_nsec) >= TICK_NS) {
+			timespec_add_ns(&next_tick, TICK_NS);
+			ticks++;
+		}
+		if (ticks == TICK_MAX_CATCHUP) {
+			next_tick = now;    // Too far behind, drop the backlog rather than spiral
+		}
+		for (int t = 0; t < ticks && !tick_stop && !death && !win_map; t++) {
+			TRACE_SCOPE("tick");
+			advance_tick();
+		}
+		if (!tick_stop) {
+			update_game_state((void*)&no_init);
+		}
 	}
+	pthread_mutex_unlock(&game_state_mutex);
+	return NULL;
+}
+
+void stop_tick_thread(pthread_t thread) {
+	pthread_mutex_lock(&game_state_mutex);
+	tick_stop = 1;
+	pthread_cond_signal(&tick_cond);
+	pthread_mutex_unlock(&game_state_mutex);
+	pthread_join(thread, NULL);
+	tick_stop = 0;
+}
+
+void save_editor() {
+	TRACE_SCOPE("save_editor");
+	build_layer_text(game_map, LAYER_BASE, LAYER_ENTITY);
+	build_layer_text(persist_map, LAYER_PERSIST, -1);
+	build_layer_text(decal_map, LAYER_DECAL, -1);
+}
+
+typedef struct {
+	char map[ROWS * (COLS + 1) + 1];
+	char persist[ROWS * (COLS + 1) + 1];
+	char decal[ROWS * (COLS + 1) + 1];
+	char next[MAP_PATH_SIZE];
+	int has_next;
+} map_text;
+
+// Reads a .map file into its sections without touching game state, safe to call from any thread
+int read_map_file(const char* filename, map_text* out) {
+	FILE* map_file = fopen(filename, "r");
 	if (map_file == NULL) {
 		return 3;
 	}
@@ -456,94 +1672,83 @@ int load_map(const char *filepath) {
 		exit(EXIT_FAILURE);
 	}
 	const size_t bytesRead = fread(buffer, 1, file_size, map_file);
-	if (bytesRead != file_size) {
+	fclose(map_file);
+	if (bytesRead != (size_t)file_size) {
 		free(buffer);
 		return 2;
 	}
 	buffer[file_size] = '\0';
-	fclose(map_file);
 
 	if(strstr(buffer, "END\n") == NULL || strstr(buffer, "map:\n") == NULL) {
 		free(buffer);
 		return 2;
 	}
 
-	char* section = strtok(buffer, "END");
+	char* saveptr;
+	char* section = strtok_r(buffer, "END", &saveptr);
 	if (strlen(section) - 5 != ROWS * (COLS + 1)) {
 		free(buffer);
 		return 2;
 	}
+	out->map[0] = '\0';
+	out->persist[0] = '\0';
+	out->decal[0] = '\0';    // Optional section, older maps have none
+	out->next[0] = '\0';
+	out->has_next = 0;
 	while (section) {
 		if (strstr(section, "map:") != NULL) {
-			section += 5;
-			int row = 0;
-			int col = 0;
-			int i = 0;
-
-			while (section[i] != '\0') {
-				if (section[i] == '\n') {
-					row++;
-					col = 0;
-				} else {
-					if (col < COLS) {
-						game_state[row][col] = section[i];
-						col++;
-					}
-				}
-
-				if (row >= ROWS) {
-					break;
-				}
-
-				i++;
-			}
+			snprintf(out->map, sizeof(out->map), "%s", section + 5);
 		} else if (strstr(section, "persist:") != NULL) {
-			section += 10;
-			int row = 0;
-			int col = 0;
-			int i = 0;
-
-			while (section[i] != '\0') {
-				if (section[i] == '\n') {
-					row++;
-					col = 0;
-				} else {
-					if (col < COLS) {
-						persist_array[row][col] = section[i];
-						col++;
-					}
-				}
-
-				if (row >= ROWS) {
-					break;
-				}
-
-				i++;
-			}
+			snprintf(out->persist, sizeof(out->persist), "%s", section + 10);
+		} else if (strstr(section, "decal:") != NULL) {
+			snprintf(out->decal, sizeof(out->decal), "%s", section + 8);
 		} else if (strstr(section, "next:") != NULL) {
-			section += 6;
-			next_map = section;
+			snprintf(out->next, sizeof(out->next), "%s", section + 6);
+			out->has_next = 1;
 		}
-		section = strtok(NULL, "END");
+		section = strtok_r(NULL, "END", &saveptr);
 	}
 
 	free(buffer);
+	return 0;
+}
+
+int load_map(const char *filepath) {
+	TRACE_SCOPE("load_map");
+	char filename[strlen(filepath) + 5];
+	snprintf(filename, sizeof(filename), "%s.map", filepath);
+	char map_name[MAP_PATH_SIZE];
+	snprintf(map_name, sizeof(map_name), "%s", filepath);    // filepath may be next_map_buffer
+
+	map_text text;
+	const int result = read_map_file(filename, &text);
+	if (result == 3) {
+		perror("fopen");
+	}
+	if (result != 0) {
+		return result;
+	}
+
+	parse_layer(text.map, LAYER_BASE);
+	parse_layer(text.persist, LAYER_PERSIST);
+	parse_layer(text.decal, LAYER_DECAL);
+	parse_layer("", LAYER_ENTITY);
+	if (text.has_next) {
+		snprintf(next_map_buffer, sizeof(next_map_buffer), "%s", text.next);
+		next_map = next_map_buffer;
+	}
 	save_editor();
+	snprintf(current_map, sizeof(current_map), "%s", map_name);
 	return 0;
 }
 
-void render_editor(const int state) {
+void render_editor(const int layer) {
 	char buffer[ROWS * (COLS * 10) + 1];
 	int index = 0;
 
 	for (int i = 0; i < ROWS; i++) {
 		for (int j = 0; j < COLS; j++) {
-			char ch;
-			if (state) {
-				ch = game_state[i][j];
-			} else {
-				ch = persist_array[i][j];
-			}
+			const char ch = editor_glyph(layer, i, j);
 			if (index + 1 < sizeof(buffer)) {
 				buffer[index++] = ch;
 			} else {
@@ -552,6 +1757,8 @@ void render_editor(const int state) {
 			}
 			if (playerY == i && playerX == j) {
 				buffer[index - 1] = '!';
+			} else if (edit_markY == i && edit_markX == j) {
+				index += snprintf(&buffer[index - 1], sizeof(buffer) - index + 1, "\x1B[7m%c\x1B[0m", ch) - 1;
 			}
 		}
 		if (index + 1 < sizeof(buffer)) {
@@ -566,11 +1773,14 @@ buffer_full:
 	buffer[index] = '\0';
 	clear_screen();
 	printf("%s", buffer);
-	printf("\nWASD - Move cursor    E - Switch map mode    Current map: %s\nQ - Quit editor    1 - Save    2 - Export map    F - Set next map: %s.map", state ? "Regular" : "Persist",next_map);
+	printf("\nWASD - Move cursor    E - Switch layer    Current layer: %s\nQ - Quit editor    1 - Save    2 - Export map    F - Set next map: %s.map"
+		"\nM - Mark    X - Fill    G - Flood fill    C - Copy    Y - Paste    H - Replace", layer_names[layer],next_map);
+	fflush(stdout);
+	clear_render_list();
 }
 
-void respawn(pthread_mutex_t game_state_mutex) {
-	pthread_mutex_lock(&game_state_mutex);
+// Caller holds game_state_mutex
+void respawn() {
 	death = 0;
 	win_map = 0;
 	death_text_printed = 0;
@@ -579,34 +1789,197 @@ void respawn(pthread_mutex_t game_state_mutex) {
 	playerY = ROWS / 2;
 	update_game_state(&init);
 	init = 0;
-	pthread_mutex_unlock(&game_state_mutex);
 }
 
-int handle_gameplay() {
-	int row = 0,col = 0;
-	for (int c = 0; persist_map[c] != '\0'; c++) {
-		if (persist_map[c] == '\n') {
-			row++;
-			col = 0;
-		} else {
-			persist_array[row][col] = persist_map[c];
-			col++;
+typedef struct {
+	int x;
+	int y;
+	int dx;
+	int dy;
+	int period;
+	int remaining;
+	char kind;
+} saved_entity;
+
+// Fixed size so a save is one bounded write or read, padding is zeroed for the checksum
+typedef struct {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int rows;
+	unsigned int cols;
+	char layers[LAYER_COUNT][ROWS][COLS];
+	char game_map[ROWS * (COLS + 1) + 1];
+	char persist_map[ROWS * (COLS + 1) + 1];
+	char decal_map[ROWS * (COLS + 1) + 1];
+	char current_map[MAP_PATH_SIZE];
+	char next_map[MAP_PATH_SIZE];
+	int playerX;
+	int playerY;
+	int collision;
+	int box_count;
+	int boxes[MAX_BOXES][2];
+	int entity_count;
+	saved_entity entities[ROWS * COLS];
+	unsigned int checksum;
+} save_state;
+
+save_state save_slot;
+volatile int resume_pending = 0;
+
+unsigned int save_checksum(const save_state* save) {
+	const unsigned char* bytes = (const unsigned char*)save;
+	unsigned int hash = 2166136261u;    // FNV-1a
+	for (size_t i = 0; i < offsetof(save_state, checksum); i++) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Caller holds game_state_mutex
+int quick_save(const char* filepath) {
+	save_state* save = &save_slot;
+	memset(save, 0, sizeof(*save));
+	save->magic = SAVE_MAGIC;
+	save->version = SAVE_VERSION;
+	save->rows = ROWS;
+	save->cols = COLS;
+	memcpy(save->layers, (const char*)layers, sizeof(save->layers));
+	memcpy(save->game_map, game_map, sizeof(save->game_map));
+	memcpy(save->persist_map, persist_map, sizeof(save->persist_map));
+	memcpy(save->decal_map, decal_map, sizeof(save->decal_map));
+	snprintf(save->current_map, sizeof(save->current_map), "%s", current_map);
+	snprintf(save->next_map, sizeof(save->next_map), "%s", next_map);
+	save->playerX = playerX;
+	save->playerY = playerY;
+	save->collision = collision;
+	save->box_count = box_count;
+	for (int i = 0; i < box_count; i++) {
+		save->boxes[i][0] = boxes[i]->x;
+		save->boxes[i][1] = boxes[i]->y;
+	}
+	for (int i = 0; i < entity_count; i++) {
+		const entity* e = &entities[i];
+		if (e->period == 0) {
+			continue;    // Dropped out of the wheel
+		}
+		save->entities[save->entity_count++] = (saved_entity){ e->x, e->y, e->dx, e->dy, e->period, (int)(e->expires - tick_now), e->kind };
+	}
+	save->checksum = save_checksum(save);
+
+	const int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		return 3;
+	}
+	const ssize_t written = write(fd, save, sizeof(*save));
+	close(fd);
+	return (written == (ssize_t)sizeof(*save)) ? 0 : 2;
+}
+
+int read_save(const char* filepath, save_state* save) {
+	const int fd = open(filepath, O_RDONLY);
+	if (fd < 0) {
+		return 3;
+	}
+	const ssize_t bytes_read = read(fd, save, sizeof(*save));
+	close(fd);
+	if (bytes_read != (ssize_t)sizeof(*save) || save->magic != SAVE_MAGIC || save->version != SAVE_VERSION
+			|| save->rows != ROWS || save->cols != COLS || save->checksum != save_checksum(save)
+			|| save->box_count < 0 || save->box_count > max_boxes
+			|| save->entity_count < 0 || save->entity_count > ROWS * COLS) {
+		return 2;
+	}
+	for (int i = 0; i < save->box_count; i++) {
+		if (save->boxes[i][0] < 0 || save->boxes[i][0] >= COLS || save->boxes[i][1] < 0 || save->boxes[i][1] >= ROWS) {
+			return 2;
+		}
+	}
+	for (int i = 0; i < save->entity_count; i++) {
+		const saved_entity* e = &save->entities[i];
+		if (e->x < 0 || e->x >= COLS || e->y < 0 || e->y >= ROWS || e->period <= 0) {
+			return 2;
+		}
+	}
+	save->current_map[MAP_PATH_SIZE - 1] = '\0';
+	save->next_map[MAP_PATH_SIZE - 1] = '\0';
+	return 0;
+}
+
+// Caller holds game_state_mutex
+void apply_save(const save_state* save) {
+	memcpy((char*)layers, save->layers, sizeof(save->layers));
+	memcpy(game_map, save->game_map, sizeof(game_map));
+	memcpy(persist_map, save->persist_map, sizeof(persist_map));
+	memcpy(decal_map, save->decal_map, sizeof(decal_map));
+	snprintf(current_map, sizeof(current_map), "%s", save->current_map);
+	snprintf(next_map_buffer, sizeof(next_map_buffer), "%s", save->next_map);
+	next_map = next_map_buffer;
+	playerX = save->playerX;
+	playerY = save->playerY;
+	collision = save->collision;
+	death = 0;
+	win_map = 0;
+	death_text_printed = 0;
+
+	reset_boxes();
+	for (int i = 0; i < save->box_count; i++) {
+		create_box(save->boxes[i][0], save->boxes[i][1]);
+	}
+	reset_entities();
+	for (int i = 0; i < save->entity_count; i++) {
+		const saved_entity* saved = &save->entities[i];
+		entity* e = &entities[entity_count++];
+		*e = (entity){ .x = saved->x, .y = saved->y, .dx = saved->dx, .dy = saved->dy, .period = saved->period, .kind = saved->kind };
+		schedule_entity(e, saved->remaining);
+	}
+
+	invalidate_composite();
+	reset_fog();
+	travel_selecting = 0;
+	travel_targetX = -1;
+	flush_composite();
+	update_fog();
+	render_game();
+	pthread_cond_signal(&tick_cond);
+}
+
+// Swallows the last position report before the terminal goes back to cooked
+// mode, where it would be echoed
+void drain_position_reports() {
+	const long long deadline = monotonic_ns() + PROBE_DRAIN_NS;
+	set_nonblocking(1, 1);
+	while (__atomic_load_n(&probe_sent_ns, __ATOMIC_ACQUIRE) != 0 && monotonic_ns() < deadline) {
+		if (read_key() == EOF) {
+			usleep(1000);
 		}
 	}
+	probe_answered();
+}
+
+int handle_gameplay() {
 	printf("\x1B[?25l");
-	init = 1;
-	update_game_state(&init);
+	if (resume_pending) {
+		// Restored straight from the save, the map is not re-parsed
+		resume_pending = 0;
+		apply_save(&save_slot);
+	} else {
+		init = 1;
+		update_game_state(&init);
+	}
 
 	pthread_t gamethread;
 
 	init = 0;
-	pthread_create(&gamethread, NULL, update_game_state, &init);
-	pthread_mutex_t game_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+	if (pthread_create(&gamethread, NULL, tick_thread, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
 
 	set_nonblocking(1, 1);
 	while (!escape_flag) {
 		if (win_map) {
 			if (!death_text_printed) {
+				pthread_mutex_lock(&game_state_mutex);
 				clear_screen();
 				const char *death_text = "\x1B[38;5;42m /$$     /$$                        /$$      /$$ /$$          \n|  $$   /$$/                       | $$  /$ | $$|__/          \n \\  $$ /$$//$$$$$$  /$$   /$$      | $$ /$$$| $$ /$$ /$$$$$$$ \n  \\  $$$$//$$__  $$| $$  | $$      | $$/$$ $$ $$| $$| $$__  $$\n   \\  $$/| $$  \\ $$| $$  | $$      | $$$$_  $$$$| $$| $$  \\ $$\n    | $$ | $$  | $$| $$  | $$      | $$$/ \\  $$$| $$| $$  | $$\n    | $$ |  $$$$$$/|  $$$$$$/      | $$/   \\  $$| $$| $$  | $$\n    |__/  \\______/  \\______/       |__/     \\__/|__/|__/  |__/\n\x1B[0m";
 				printf("%s",death_text);
@@ -615,11 +1988,14 @@ int handle_gameplay() {
 				}
 				printf("-%c to respawn   -%c to quit to menu",keybinds[4],keybinds[5]);
 				death_text_printed = 1;
+				pthread_mutex_unlock(&game_state_mutex);
 				set_nonblocking(1, 0);
 			} else {
-				const char ch = tolower(getchar());
+				const char ch = tolower(read_key());
 				if (ch ==keybinds[4]) {
-				    respawn(game_state_mutex);
+					pthread_mutex_lock(&game_state_mutex);
+				    respawn();
+					pthread_mutex_unlock(&game_state_mutex);
 				}
 				if (ch ==keybinds[7]) {
 				    if (strcmp(next_map,"") != 0) {
@@ -628,6 +2004,7 @@ int handle_gameplay() {
 						death_text_printed = 0;
 						set_nonblocking(1, 1);
 						pthread_mutex_unlock(&game_state_mutex);
+						stop_tick_thread(gamethread);
 						return 5;
 					}
 				}
@@ -641,14 +2018,18 @@ int handle_gameplay() {
 		} else {
 			if (death) {
 				if (!death_text_printed) {
+					pthread_mutex_lock(&game_state_mutex);
 					clear_screen();
 					printf("\x1B[41m /$$     /$$                        /$$$$$$$  /$$                 /$$\n|  $$   /$$/                       | $$__  $$|__/                | $$\n \\  $$ /$$//$$$$$$  /$$   /$$      | $$  \\ $$ /$$  /$$$$$$   /$$$$$$$\n  \\  $$$$//$$__  $$| $$  | $$      | $$  | $$| $$ /$$__  $$ /$$__  $$\n   \\  $$/| $$  \\ $$| $$  | $$      | $$  | $$| $$| $$$$$$$$| $$  | $$\n    | $$ | $$  | $$| $$  | $$      | $$  | $$| $$| $$_____/| $$  | $$\n    | $$ |  $$$$$$/|  $$$$$$/      | $$$$$$$/| $$|  $$$$$$$|  $$$$$$$\n    |__/  \\______/  \\______/       |_______/ |__/ \\_______/ \\_______/\n\x1B[0m-%c to respawn   -%c to quit to menu",keybinds[4],keybinds[5]);
 					death_text_printed = 1;
+					pthread_mutex_unlock(&game_state_mutex);
 					set_nonblocking(1, 0);
 				} else {
-					const char ch = tolower(getchar());
+					const char ch = tolower(read_key());
 					if (ch ==keybinds[4]) {
-				        respawn(game_state_mutex);
+						pthread_mutex_lock(&game_state_mutex);
+				        respawn();
+						pthread_mutex_unlock(&game_state_mutex);
 				    }
 				    if (ch ==keybinds[5]) {
     				    death = 0;
@@ -658,11 +2039,13 @@ int handle_gameplay() {
 				    }
 				}
 			} else {
-				const char ch = tolower(getchar());
+				const char ch = tolower(read_key());
+				pthread_mutex_lock(&game_state_mutex);
 				if (ch != EOF) {
-					const char* found_char = strchr(keybinds, ch);
-				    if (found_char != NULL) {
-					    const int index =  (int)(found_char - keybinds);
+					const int index = keybind_index(ch);
+					if (travel_selecting) {
+						travel_key(ch);
+					} else if (index >= 0) {
 				    	if (index <= 3 && index >= 0 ) {
 				    		const Move move = get_move(ch);
 				    		if (box_check(playerX + move.dx, playerY + move.dy, move.dir ) == 1 && check_collision(playerX + move.dx, playerY + move.dy)) {
@@ -675,15 +2058,48 @@ int handle_gameplay() {
 				    		clear_screen();
 				    	}
 				    	if (ch == keybinds[4]) {
-				    		respawn(game_state_mutex);
+				    		respawn();
 				    	}
 				    	if (ch == keybinds[8]) {
 				    		collision = !collision;  //noclip toggle
+				    		invalidate_screen();    // NOCLIP lives on the help line
+				    	}
+				    	if (ch == keybinds[16]) {
+				    		fog_enabled = !fog_enabled;
+				    		reset_fog();
+				    	}
+				    	if (ch == keybinds[17]) {
+				    		travel_selecting = 1;
+				    		travel_cursorX = playerX;
+				    		travel_cursorY = playerY;
+				    		mark_render(travel_cursorY, travel_cursorX);
+				    	}
+				    	if (ch == keybinds[14]) {
+				    		if (quick_save(SAVE_FILE) == 0) {
+				    			show_status(GAME_STATUS_ROW, "Game saved.");
+				    		} else {
+				    			show_status(GAME_STATUS_ROW, "Quick save failed.");
+				    		}
+				    	}
+				    	if (ch == keybinds[15]) {
+				    		switch (read_save(SAVE_FILE, &save_slot)) {
+				    		case 0:
+				    			apply_save(&save_slot);
+				    			break;
+				    		case 3:
+				    			show_status(GAME_STATUS_ROW, "No quick save found.");
+				    			break;
+				    		default:
+				    			show_status(GAME_STATUS_ROW, "Quick save is corrupted.");
+				    			break;
+				    		}
 				    	}
 				    }
 					if (!escape_flag) {
 						update_game_state(&init);
 					}
+				} else if (frame_pending) {
+					render_game();
 				}
 				if (!escape_flag) {
 					if (game_state[playerY][playerX] == 'P' && collision) {
@@ -693,53 +2109,377 @@ int handle_gameplay() {
 						death = 1;
 					}
 				}
+				pthread_mutex_unlock(&game_state_mutex);
 			}
 		}
 	}
+	stop_tick_thread(gamethread);
+	drain_position_reports();
 	set_nonblocking(0, 0);
 
-	pthread_join(gamethread, NULL);
-	pthread_mutex_destroy(&game_state_mutex);
-
 	reset_boxes();
 	return 1;
 }
 
-int handle_editor() {
-	int x = 0, y = 0;
-	for (int i = 0; game_map[i] != '\0'; i++) {
-		if (game_map[i] == '\n') {
-			y++;
-			x = 0;
-			continue;
+typedef struct {
+	char path[MAP_PATH_SIZE + 8];
+	char* contents;
+	size_t length;
+	int autosave;
+} write_job;
+
+write_job writer_queue[WRITER_QUEUE_SIZE];
+int writer_queue_count = 0;
+int writer_running = 0;
+int writer_stop = 0;
+pthread_t writer_thread;
+pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+char writer_status[MAP_PATH_SIZE + 64];
+volatile int writer_status_seq = 0;
+
+// Returns the length, or -1 when the map does not fit rather than writing a truncated file
+int format_map_file(char* out, const size_t size, const char* map, const char* persist, const char* decal, const char* next) {
+	const int length = snprintf(out, size, "map:\n%sEND\npersist:\n%sEND\ndecal:\n%sEND\nnext:%sEND\n", map, persist, decal, next);
+	return (length >= 0 && length < (int)size) ? length : -1;
+}
+
+// Writes beside the target, syncs, then renames over it so a crash leaves
+// either the old file or the new one, never a truncated map. Returns 0 or an errno.
+int write_file_atomic(const char* filepath, const char* contents, const size_t length) {
+	char temp_path[strlen(filepath) + 5];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", filepath);
+	const int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return errno;
+	}
+	size_t written = 0;
+	while (written < length) {
+		const ssize_t result = write(fd, contents + written, length - written);
+		if (result < 0) {
+			const int error = errno;
+			close(fd);
+			unlink(temp_path);
+			return error;
 		}
-		if (y >= ROWS) break;
-		if (x < COLS) {
-			game_state[y][x] = game_map[i];
+		written += (size_t)result;
+	}
+	if (fsync(fd) != 0 || close(fd) != 0 || rename(temp_path, filepath) != 0) {
+		const int error = errno;
+		unlink(temp_path);
+		return error;
+	}
+
+	char directory[strlen(filepath) + 2];
+	snprintf(directory, sizeof(directory), "%s", filepath);
+	char* slash = strrchr(directory, '/');
+	if (slash != NULL) {
+		slash[1] = '\0';
+	} else {
+		snprintf(directory, sizeof(directory), ".");
+	}
+	const int dir_fd = open(directory, O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	return 0;
+}
+
+void* writer_loop(void* arg) {
+	TRACE_THREAD("writer");
+	pthread_mutex_lock(&writer_mutex);
+	for (;;) {
+		while (writer_queue_count == 0 && !writer_stop) {
+			pthread_cond_wait(&writer_cond, &writer_mutex);
+		}
+		if (writer_queue_count == 0) {
+			break;    // Stopping, and everything queued has been written
+		}
+		const write_job job = writer_queue[0];
+		writer_queue_count--;
+		memmove(&writer_queue[0], &writer_queue[1], writer_queue_count * sizeof(write_job));
+		pthread_mutex_unlock(&writer_mutex);
+
+		int result;
+		{
+			TRACE_SCOPE(job.autosave ? "autosave" : "export");
+			result = write_file_atomic(job.path, job.contents, job.length);
+		}
+		char status[sizeof(writer_status)];
+		if (result == 0) {
+			snprintf(status, sizeof(status), "%s. (%s)", job.autosave ? "Autosaved" : "Map Exported", job.path);
+		} else {
+			snprintf(status, sizeof(status), "%s failed: %s (%s)", job.autosave ? "Autosave" : "Export", strerror(result), job.path);
+		}
+		free(job.contents);
+
+		pthread_mutex_lock(&writer_mutex);
+		memcpy(writer_status, status, sizeof(writer_status));
+		writer_status_seq++;
+	}
+	pthread_mutex_unlock(&writer_mutex);
+	return NULL;
+}
+
+void writer_shutdown() {
+	pthread_mutex_lock(&writer_mutex);
+	writer_stop = 1;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+	pthread_join(writer_thread, NULL);
+}
+
+// Hands the contents to the background writer, a queued job for the same
+// path is replaced so only the newest version gets written
+void queue_write(const char* filepath, const char* contents, const size_t length, const int autosave) {
+	char* copy = malloc(length);
+	if (copy == NULL) {
+		perror("Failed to allocate memory for write");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(copy, contents, length);
+
+	pthread_mutex_lock(&writer_mutex);
+	if (!writer_running) {
+		if (pthread_create(&writer_thread, NULL, writer_loop, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		writer_running = 1;
+		atexit(writer_shutdown);
+	}
+	int slot = -1;
+	for (int i = 0; i < writer_queue_count; i++) {
+		if (strcmp(writer_queue[i].path, filepath) == 0) {
+			slot = i;
+			free(writer_queue[i].contents);
+			break;
+		}
+	}
+	while (slot < 0 && writer_queue_count == WRITER_QUEUE_SIZE) {
+		pthread_mutex_unlock(&writer_mutex);    // Queue full, let the writer catch up
+		usleep(1000);
+		pthread_mutex_lock(&writer_mutex);
+	}
+	if (slot < 0) {
+		slot = writer_queue_count++;
+	}
+	write_job* job = &writer_queue[slot];
+	snprintf(job->path, sizeof(job->path), "%s", filepath);
+	job->contents = copy;
+	job->length = length;
+	job->autosave = autosave;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+void queue_autosave() {
+	char map_text[ROWS * (COLS + 1) + 1];
+	char persist_text[ROWS * (COLS + 1) + 1];
+	char decal_text[ROWS * (COLS + 1) + 1];
+	char contents[MAP_FILE_SIZE];
+	build_layer_text(map_text, LAYER_BASE, LAYER_ENTITY);
+	build_layer_text(persist_text, LAYER_PERSIST, -1);
+	build_layer_text(decal_text, LAYER_DECAL, -1);
+	const int length = format_map_file(contents, sizeof(contents), map_text, persist_text, decal_text, next_map);
+	if (length >= 0) {
+		queue_write(AUTOSAVE_FILE, contents, length, 1);
+	}
+}
+
+int edit_cell(const int layer, const int y, const int x, const char ch) {
+	if (editor_glyph(layer, y, x) == ch) {
+		return 0;
+	}
+	const int had_box = (editor_glyph(LAYER_BASE, y, x) == '%');
+	edit_log[edit_log_count++] = (edit_undo){ y * COLS + x, layers[layer][y][x], layers[LAYER_ENTITY][y][x] };
+	set_editor_glyph(layer, y, x, ch);
+	edit_boxes += (editor_glyph(LAYER_BASE, y, x) == '%') - had_box;
+	mark_render(y, x);
+	return 1;
+}
+
+// Undoes the last edit if it left more boxes than max_boxes, returns 1 when it did
+int edit_check_boxes(const int layer) {
+	if (edit_boxes <= max_boxes) {
+		edit_log_count = 0;
+		return 0;
+	}
+	while (edit_log_count > 0) {
+		const edit_undo* undo = &edit_log[--edit_log_count];
+		const int y = undo->cell / COLS;
+		const int x = undo->cell % COLS;
+		const int had_box = (editor_glyph(LAYER_BASE, y, x) == '%');
+		layers[layer][y][x] = undo->glyph;
+		layers[LAYER_ENTITY][y][x] = undo->entity;
+		edit_boxes += (editor_glyph(LAYER_BASE, y, x) == '%') - had_box;
+		mark_render(y, x);
+	}
+	return 1;
+}
+
+int count_editor_boxes() {
+	int count = 0;
+	for (int y = 0; y < ROWS; y++) {
+		for (int x = 0; x < COLS; x++) {
+			count += (editor_glyph(LAYER_BASE, y, x) == '%');
+		}
+	}
+	return count;
+}
+
+// Without a mark the selection is just the cursor cell
+void edit_selection(int* left, int* top, int* right, int* bottom) {
+	const int markX = (edit_markX >= 0) ? edit_markX : playerX;
+	const int markY = (edit_markY >= 0) ? edit_markY : playerY;
+	*left = (markX < playerX) ? markX : playerX;
+	*right = (markX > playerX) ? markX : playerX;
+	*top = (markY < playerY) ? markY : playerY;
+	*bottom = (markY > playerY) ? markY : playerY;
+}
+
+int edit_fill(const int layer, const char ch) {
+	int left, top, right, bottom;
+	edit_selection(&left, &top, &right, &bottom);
+	int changed = 0;
+	for (int y = top; y <= bottom; y++) {
+		for (int x = left; x <= right; x++) {
+			changed += edit_cell(layer, y, x, ch);
+		}
+	}
+	return changed;
+}
+
+// Replaces the 4-connected run of the glyph under the cursor
+int edit_flood(const int layer, const char ch) {
+	const char from = editor_glyph(layer, playerY, playerX);
+	if (from == ch) {
+		return 0;
+	}
+	int stack[ROWS * COLS];
+	int top = 0;
+	int changed = edit_cell(layer, playerY, playerX, ch);
+	stack[top++] = playerY * COLS + playerX;
+	while (top > 0) {
+		const int y = stack[--top] / COLS;
+		const int x = stack[top] % COLS;
+		for (int d = 0; d < 4; d++) {
+			const int ny = y + travel_dirs[d][1];
+			const int nx = x + travel_dirs[d][0];
+			if (nx >= 0 && nx < COLS && ny >= 0 && ny < ROWS && editor_glyph(layer, ny, nx) == from) {
+				changed += edit_cell(layer, ny, nx, ch);
+				stack[top++] = ny * COLS + nx;
+			}
+		}
+	}
+	return changed;
+}
+
+void edit_copy(const int layer) {
+	int left, top, right, bottom;
+	edit_selection(&left, &top, &right, &bottom);
+	clipboard.width = right - left + 1;
+	clipboard.height = bottom - top + 1;
+	for (int y = 0; y < clipboard.height; y++) {
+		for (int x = 0; x < clipboard.width; x++) {
+			clipboard.cells[y][x] = editor_glyph(layer, top + y, left + x);
+		}
+	}
+}
+
+// Pastes with the cursor as the top left corner, clipped to the map. Copying
+// on one layer and pasting after E moves regions between layers.
+int edit_paste(const int layer) {
+	int changed = 0;
+	for (int y = 0; y < clipboard.height && playerY + y < ROWS; y++) {
+		for (int x = 0; x < clipboard.width && playerX + x < COLS; x++) {
+			changed += edit_cell(layer, playerY + y, playerX + x, clipboard.cells[y][x]);
+		}
+	}
+	return changed;
+}
+
+// Within the selection when a mark is set, otherwise across the whole layer
+int edit_replace(const int layer, const char from, const char to) {
+	int left = 0, top = 0, right = COLS - 1, bottom = ROWS - 1;
+	if (edit_markX >= 0) {
+		edit_selection(&left, &top, &right, &bottom);
+	}
+	int changed = 0;
+	for (int y = top; y <= bottom; y++) {
+		for (int x = left; x <= right; x++) {
+			if (editor_glyph(layer, y, x) == from) {
+				changed += edit_cell(layer, y, x, to);
+			}
 		}
-		x++;
 	}
-	int row = 0,col = 0;
-	for (int c = 0; persist_map[c] != '\0'; c++) {
-		if (persist_map[c] == '\n') {
-			row++;
-			col = 0;
+	return changed;
+}
+
+// Prompts on the editor status row for the glyph argument of a bulk edit.
+// read_key turns arrows into the movement keybinds, so those cancel like ESC.
+char read_edit_glyph(const char* prompt) {
+	show_status(EDITOR_STATUS_ROW, prompt);
+	set_nonblocking(1, 0);
+	const char ch = read_key();
+	set_nonblocking(1, 1);
+	const int index = keybind_index(ch);
+	if (ch == 27 || (index >= 0 && index <= 3) || !isprint(ch)) {
+		return '\0';
+	}
+	return ch;
+}
+
+// Redraws only the cells queued by bulk edits
+void render_editor_cells(const int layer) {
+	printf("\x1B" "7");
+	for (int i = 0; i < render_count; i++) {
+		const int y = render_cells[i] / COLS;
+		const int x = render_cells[i] % COLS;
+		if (y == playerY && x == playerX) {
+			printf("\x1B[%d;%dH!", y + 1, x + 1);
+		} else if (y == edit_markY && x == edit_markX) {
+			printf("\x1B[%d;%dH\x1B[7m%c\x1B[0m", y + 1, x + 1, editor_glyph(layer, y, x));
 		} else {
-			persist_array[row][col] = persist_map[c];
-			col++;
+			printf("\x1B[%d;%dH%c", y + 1, x + 1, editor_glyph(layer, y, x));
 		}
 	}
-	int map_mode = 1;        // Boolean, persist map editing or general map
+	printf("\x1B" "8");
+	fflush(stdout);
+	clear_render_list();
+}
+
+int handle_editor() {
+	parse_map_layers();
+	edit_markX = -1;
+	edit_markY = -1;
+	edit_log_count = 0;
+	edit_boxes = count_editor_boxes();
+	int map_layer = LAYER_BASE;
+	int unsaved_edits = 0;
+	int shown_status = writer_status_seq;
+	time_t last_autosave = time(NULL);
 	printf("\x1B[?25l");
 	set_nonblocking(1, 1);
-	render_editor(map_mode);
+	render_editor(map_layer);
 
 	while (!escape_flag) {
-		const char ch = tolower(getchar());
+		if (writer_status_seq != shown_status) {
+			pthread_mutex_lock(&writer_mutex);
+			shown_status = writer_status_seq;
+			show_status(EDITOR_STATUS_ROW, writer_status);
+			pthread_mutex_unlock(&writer_mutex);
+		}
+		if (unsaved_edits && time(NULL) - last_autosave >= AUTOSAVE_SECONDS) {
+			queue_autosave();
+			unsaved_edits = 0;
+			last_autosave = time(NULL);
+		}
+		const char ch = tolower(read_key());
 		if (ch != EOF) {
-			const char* found_char = strchr(keybinds, ch);
-			if (found_char != NULL) {
-				const int index =  (int)(found_char - keybinds);
+			const int index = keybind_index(ch);
+			if (index >= 0) {
 				if (index <= 3 && index >= 0 ) {
 		    		const Move move = get_move(ch);
 	    			playerX += move.dx;
@@ -749,14 +2489,65 @@ int handle_editor() {
 		    	}
 
 				if (ch == keybinds[9]) {
-					map_mode = !map_mode;
+					map_layer = (map_layer + 1) % LAYER_COUNT;
+				}
+				if (ch == keybinds[18]) {
+					// Marking the marked cell again clears the selection
+					const int clear = (edit_markX == playerX && edit_markY == playerY);
+					edit_markX = clear ? -1 : playerX;
+					edit_markY = clear ? -1 : playerY;
+				}
+				if (ch == keybinds[19] || ch == keybinds[20] || ch == keybinds[21] || ch == keybinds[22] || ch == keybinds[23]) {
+					int changed = 0;
+					int cancelled = 0;
+					if (ch == keybinds[19]) {
+						const char glyph = read_edit_glyph("Fill selection with: ");
+						changed = glyph ? edit_fill(map_layer, glyph) : 0;
+						cancelled = !glyph;
+					} else if (ch == keybinds[20]) {
+						const char glyph = read_edit_glyph("Flood fill with: ");
+						changed = glyph ? edit_flood(map_layer, glyph) : 0;
+						cancelled = !glyph;
+					} else if (ch == keybinds[21]) {
+						edit_copy(map_layer);
+						char message[64];
+						snprintf(message, sizeof(message), "Copied %dx%d.", clipboard.width, clipboard.height);
+						show_status(EDITOR_STATUS_ROW, message);
+					} else if (ch == keybinds[22]) {
+						changed = edit_paste(map_layer);
+					} else {
+						const char from = read_edit_glyph("Replace: ");
+						const char to = from ? read_edit_glyph("With: ") : '\0';
+						changed = to ? edit_replace(map_layer, from, to) : 0;
+						cancelled = !to;
+					}
+					const int too_many = edit_check_boxes(map_layer);
+					if (changed > 0 && !too_many) {
+						unsaved_edits = 1;
+					}
+					render_editor_cells(map_layer);
+					if (ch != keybinds[21]) {
+						char message[64];
+						if (too_many) {
+							snprintf(message, sizeof(message), "Too many boxes, a map holds at most %d.", max_boxes);
+						} else if (cancelled) {
+							snprintf(message, sizeof(message), "Cancelled.");
+						} else {
+							snprintf(message, sizeof(message), "%d cells changed.", changed);
+						}
+						show_status(EDITOR_STATUS_ROW, message);
+					}
+					continue;
 				}
 				if (ch == keybinds[5]) {
+					if (unsaved_edits) {
+						queue_autosave();
+					}
 					return 1;
 				}
 				if (ch == keybinds[10]) {
 					save_editor();
-					printf("\n\nMap Saved.");
+					show_status(EDITOR_STATUS_ROW, "Map Saved.");
 					continue;
 				}
 				if (ch == keybinds[11]) {
@@ -765,27 +2556,37 @@ int handle_editor() {
 					printf("\n\nMap name: ");
 					set_nonblocking(0,0);
 					char* input = get_user_input();
-					set_nonblocking(1,0);
+					set_nonblocking(1,1);    // Keep polling for writer status
 					if (input != NULL) {
-    					if (strlen(input) > 0) {
-    					    render_editor(map_mode);
+    					char filepath[MAP_PATH_SIZE];
+    					char contents[MAP_FILE_SIZE];
+    					const int length = format_map_file(contents, sizeof(contents), game_map, persist_map, decal_map, next_map);
+    					if (strlen(input) + 4 >= sizeof(filepath) || length < 0) {
+    					    render_editor(map_layer);
     						printf("\x1B[?25l");
-    						FILE *map_file = fopen(strcat(input,".map"),"w");
-    						fprintf(map_file,"map:\n%sEND\npersist:\n%sEND\nnext:%sEND\n", game_map, persist_map, next_map);
-    						fclose(map_file);
-    						printf("\n\nMap Exported. (%s)",input);
+    						show_status(EDITOR_STATUS_ROW, "Map name is too long.");
+    					} else if (strlen(input) > 0) {
+    					    render_editor(map_layer);
+    						printf("\x1B[?25l");
+    						snprintf(filepath, sizeof(filepath), "%s.map", input);
+    						queue_write(filepath, contents, length, 0);
+    						char message[MAP_PATH_SIZE + 32];
+    						snprintf(message, sizeof(message), "Exporting... (%s)", filepath);
+    						show_status(EDITOR_STATUS_ROW, message);
     					}else {
-    					    render_editor(map_mode);
+    					    render_editor(map_layer);
     						printf("\x1B[?25l");
-    						printf("\n\nMap name must be more than one character.");
+    						show_status(EDITOR_STATUS_ROW, "Map name must be more than one character.");
     					}
 					}else {
-					    render_editor(map_mode);
+					    render_editor(map_layer);
 						printf("\x1B[?25l");
-						printf("\n\nMap name must be more than one character.");
+						show_status(EDITOR_STATUS_ROW, "Map name must be more than one character.");
 					}
 						
-    				free(input);
+    				if (*input) {
+    					free(input);
+    				}
     				continue;
 					
 				}
@@ -793,36 +2594,901 @@ int handle_editor() {
 					printf("\x1B[?25h");
 					printf("\n\nMap name: ");
 					set_nonblocking(0,0);
-					const char* next_input = get_user_input();
-					set_nonblocking(1,0);
-					if(*next_input && strcmp(next_input,"") != 0) {
-						printf("\x1B[?25l");
-						next_map = next_input;
-						render_editor(map_mode);
+					char* next_input = get_user_input();
+					set_nonblocking(1,1);    // Keep polling for writer status and autosave
+					printf("\x1B[?25l");
+					if (strlen(next_input) + 4 >= sizeof(next_map_buffer)) {
+						render_editor(map_layer);
+						show_status(EDITOR_STATUS_ROW, "Map name is too long.");
+					} else if (*next_input) {
+						snprintf(next_map_buffer, sizeof(next_map_buffer), "%s", next_input);
+						next_map = next_map_buffer;
+						render_editor(map_layer);
+					}
+					if (*next_input) {
+						free(next_input);
 					}
 					continue;
 				}
 			}else {
 				if (isprint(ch)) {
-					if (map_mode) {
-						game_state[playerY][playerX] = ch;
-					} else {
-						persist_array[playerY][playerX] = ch;
+					edit_cell(map_layer, playerY, playerX, ch);
+					if (edit_check_boxes(map_layer)) {
+						render_editor(map_layer);
+						char message[64];
+						snprintf(message, sizeof(message), "Too many boxes, a map holds at most %d.", max_boxes);
+						show_status(EDITOR_STATUS_ROW, message);
+						continue;
 					}
+					unsaved_edits = 1;
 				}
 			}
-			render_editor(map_mode);
+			render_editor(map_layer);
 		}
 	}
 	return 4;
 }
 
+#define GEN_STEPS 600
+#define GEN_MIN_PULLS 12
+#define GEN_ATTEMPTS 64
+
+typedef struct {
+	char map[ROWS][COLS];
+	char persist[ROWS][COLS];
+	unsigned char visited[ROWS][COLS]; // 1 - player walked here, 2 - box was here
+	unsigned char box_at[ROWS][COLS];
+	int playerX;
+	int playerY;
+	int boxes;
+	int pulls;
+	int move_count;
+	char moves[GEN_STEPS + 2];     // Reversed, last entry is the first move to play
+} generated_map;
+
+typedef struct {
+	unsigned long long seed;
+	const char* prefix;
+	int count;
+	volatile int next_index;
+	volatile int written;
+	volatile int failed;
+	pthread_mutex_t output_mutex;
+} generator_job;
+
+const int gen_dirs[4][2] = {{0,-1},{-1,0},{0,1},{1,0}};
+const char gen_dir_keys[4] = {'w','a','s','d'};
+
+unsigned long long gen_next(unsigned long long* state) {
+	unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+int gen_range(unsigned long long* state, const int range) {
+	return (int)(gen_next(state) % (unsigned long long)range);
+}
+
+int gen_in_bounds(const int x, const int y) {
+	return x >= 0 && x < COLS && y >= 0 && y < ROWS;
+}
+
+int gen_walkable(const generated_map* gen, const int x, const int y) {
+	return gen_in_bounds(x, y) && gen->map[y][x] == '.' && !gen->box_at[y][x];
+}
+
+// Plays the level backwards from the goal: every step taken here is the
+// inverse of a legal forward move, so the reversed move list is a solution.
+int generate_map(unsigned long long seed, generated_map* gen) {
+	for (int attempt = 0; attempt < GEN_ATTEMPTS; attempt++) {
+		memset(gen, 0, sizeof(*gen));
+		for (int i = 0; i < ROWS; i++) {
+			for (int j = 0; j < COLS; j++) {
+				gen->map[i][j] = gen_range(&seed, 8) == 0 ? '#' : '.';
+				gen->persist[i][j] = '.';
+			}
+		}
+
+		const int goalX = gen_range(&seed, COLS);
+		const int goalY = gen_range(&seed, ROWS);
+		const int last_dir = gen_range(&seed, 4);
+		gen->playerX = goalX - gen_dirs[last_dir][0];
+		gen->playerY = goalY - gen_dirs[last_dir][1];
+		if (!gen_in_bounds(gen->playerX, gen->playerY)) {
+			continue;
+		}
+		gen->map[goalY][goalX] = 'P';
+		gen->map[gen->playerY][gen->playerX] = '.';
+		gen->visited[goalY][goalX] = 1;
+		gen->visited[gen->playerY][gen->playerX] = 1;
+		gen->moves[gen->move_count++] = gen_dir_keys[last_dir];
+
+		const int start_boxes = 1 + gen_range(&seed, max_boxes / 3);
+		for (int b = 0; b < start_boxes * 4 && gen->boxes < start_boxes; b++) {
+			const int x = gen_range(&seed, COLS);
+			const int y = gen_range(&seed, ROWS);
+			if (gen_walkable(gen, x, y) && !(x == gen->playerX && y == gen->playerY)) {
+				gen->box_at[y][x] = 1;
+				gen->visited[y][x] |= 2;
+				gen->boxes++;
+			}
+		}
+
+		for (int step = 0; step < GEN_STEPS; step++) {
+			const int dir = gen_range(&seed, 4);
+			const int dx = gen_dirs[dir][0];
+			const int dy = gen_dirs[dir][1];
+			const int px = gen->playerX;
+			const int py = gen->playerY;
+			const int backX = px - dx;
+			const int backY = py - dy;
+			const int frontX = px + dx;
+			const int frontY = py + dy;
+			if (!gen_walkable(gen, backX, backY)) {
+				continue;
+			}
+
+			if (gen_in_bounds(frontX, frontY) && gen->box_at[frontY][frontX] && gen_range(&seed, 10) < 8) {
+				// Inverse of a push: the box follows the player one cell
+				gen->box_at[frontY][frontX] = 0;
+				gen->box_at[py][px] = 1;
+				gen->visited[py][px] |= 2;
+				gen->pulls++;
+			} else if (gen_in_bounds(frontX, frontY) && gen->map[frontY][frontX] == '.' && !gen->box_at[frontY][frontX]
+					&& gen->boxes < max_boxes && gen_range(&seed, 12) == 0) {
+				// Inverse of pushing a box into a hazard, which fills it
+				gen->map[frontY][frontX] = '_';
+				gen->box_at[py][px] = 1;
+				gen->visited[py][px] |= 2;
+				gen->boxes++;
+				gen->pulls++;
+			}
+			gen->playerX = backX;
+			gen->playerY = backY;
+			gen->visited[backY][backX] |= 1;
+			gen->moves[gen->move_count++] = gen_dir_keys[dir];
+		}
+
+		if (gen->pulls < GEN_MIN_PULLS) {
+			continue;
+		}
+
+		// Cells the solution never touches are free to decorate
+		for (int i = 0; i < ROWS; i++) {
+			for (int j = 0; j < COLS; j++) {
+				if (gen->visited[i][j] || gen->map[i][j] != '.') {
+					continue;
+				}
+				const int roll = gen_range(&seed, 20);
+				if (roll < 4) {
+					gen->map[i][j] = '#';
+				} else if (roll < 7) {
+					gen->map[i][j] = '_';
+				} else if (roll < 8) {
+					gen->map[i][j] = ' ';
+				} else if (roll < 10) {
+					gen->persist[i][j] = '=';
+				}
+			}
+		}
+		for (int i = 0; i < ROWS; i++) {
+			for (int j = 0; j < COLS; j++) {
+				if (gen->box_at[i][j]) {
+					gen->map[i][j] = '%';
+				}
+			}
+		}
+		gen->map[gen->playerY][gen->playerX] = '@';
+		return 1;
+	}
+	return 0;
+}
+
+int write_generated_map(const char* filepath, const generated_map* gen) {
+	char map_text[ROWS * (COLS + 1) + 1];
+	char persist_text[ROWS * (COLS + 1) + 1];
+	int index = 0;
+	for (int i = 0; i < ROWS; i++) {
+		memcpy(&map_text[index], gen->map[i], COLS);
+		memcpy(&persist_text[index], gen->persist[i], COLS);
+		index += COLS;
+		map_text[index] = '\n';
+		persist_text[index] = '\n';
+		index++;
+	}
+	map_text[index] = '\0';
+	persist_text[index] = '\0';
+
+	FILE* map_file = fopen(filepath, "w");
+	if (map_file == NULL) {
+		perror("fopen");
+		return 3;
+	}
+	fprintf(map_file, "map:\n%sEND\npersist:\n%sEND\nnext:END\n", map_text, persist_text);
+	if (fclose(map_file) != 0) {
+		perror("fclose");
+		return 2;
+	}
+	return 0;
+}
+
+void* generator_worker(void* arg) {
+	generator_job* job = (generator_job*)arg;
+	generated_map* gen = malloc(sizeof(generated_map));
+	if (gen == NULL) {
+		perror("Failed to allocate memory for map generation");
+		exit(EXIT_FAILURE);
+	}
+
+	char filepath[strlen(job->prefix) + 32];
+	char solution[GEN_STEPS + 2];
+	int index;
+	TRACE_THREAD("generator");
+	while ((index = __atomic_fetch_add(&job->next_index, 1, __ATOMIC_RELAXED)) < job->count) {
+		// Seeded per map rather than per thread so output is independent of core count
+		TRACE_SCOPE("generate_map");
+		unsigned long long seed = job->seed ^ ((unsigned long long)index * 0xD1B54A32D192ED03ULL);
+		gen_next(&seed);
+		snprintf(filepath, sizeof(filepath), "%s%d.map", job->prefix, index);
+		if (!generate_map(seed, gen) || write_generated_map(filepath, gen) != 0) {
+			__atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		for (int m = 0; m < gen->move_count; m++) {
+			solution[m] = gen->moves[gen->move_count - 1 - m];
+		}
+		solution[gen->move_count] = '\0';
+
+		pthread_mutex_lock(&job->output_mutex);
+		printf("%s %s\n", filepath, solution);
+		pthread_mutex_unlock(&job->output_mutex);
+		__atomic_fetch_add(&job->written, 1, __ATOMIC_RELAXED);
+	}
+	free(gen);
+	return NULL;
+}
+
+int handle_generate(int argc, char *argv[]) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s generate <count> [seed] [prefix]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	generator_job job = {
+		.seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1,
+		.prefix = argc > 4 ? argv[4] : "maps/gen",
+		.count = atoi(argv[2]),
+		.next_index = 0,
+		.written = 0,
+		.failed = 0,
+		.output_mutex = PTHREAD_MUTEX_INITIALIZER
+	};
+
+	long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (thread_count < 1) {
+		thread_count = 1;
+	}
+	pthread_t threads[thread_count];
+	for (long t = 0; t < thread_count; t++) {
+		if (pthread_create(&threads[t], NULL, generator_worker, &job) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (long t = 0; t < thread_count; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	pthread_mutex_destroy(&job.output_mutex);
+
+	fprintf(stderr, "Generated %d maps (%d failed).\n", job.written, job.failed);
+	return job.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#define SIM_PLAYING 0
+#define SIM_WIN 1
+#define SIM_DEATH 2
+
+// Headless copy of the movement rules (box_check, check_collision, the
+// base wipe in update_game_state and the P/_/space checks in
+// handle_gameplay) over flat ROWS*COLS arrays. Timed entities are frozen
+// in their load state since a move string carries no timing.
+typedef struct {
+	char base[ROWS * COLS];
+	char persist[ROWS * COLS];
+	unsigned char box_at[ROWS * COLS];
+	int player;
+	int box_count;
+} sim_map;
+
+typedef struct {
+	const char* path;
+	const char* moves;
+	int map;
+	int result;            // SIM_* or -1 when the line could not be checked
+	int moves_made;
+	int pushes;
+} verify_entry;
+
+typedef struct {
+	verify_entry* entries;
+	int count;
+	sim_map* maps;
+	volatile int next_entry;
+	volatile long long moves_replayed;
+} verify_job;
+
+char sim_terrain(const char* base, const char* persist, const int cell) {
+	const char terrain = (persist[cell] != '.') ? persist[cell] : base[cell];
+	if (terrain == '#' || terrain == '=' || terrain == '_' || terrain == ' ' || terrain == 'P') {
+		return terrain;
+	}
+	return '.';
+}
+
+// Returns 0, 3 if the map is missing or 2 if it is malformed or has too many boxes
+int sim_load(const char* filename, sim_map* sim) {
+	map_text text;
+	const int result = read_map_file(filename, &text);
+	if (result != 0) {
+		return result;
+	}
+	memset(sim, 0, sizeof(*sim));
+	memset(sim->base, '.', sizeof(sim->base));
+	memset(sim->persist, '.', sizeof(sim->persist));
+	sim->player = (ROWS / 2) * COLS + COLS / 2;
+
+	const char* texts[2] = {text.map, text.persist};
+	char* targets[2] = {sim->base, sim->persist};
+	for (int t = 0; t < 2; t++) {
+		int x = 0, y = 0;
+		for (int i = 0; texts[t][i] != '\0'; i++) {
+			if (texts[t][i] == '\n') {
+				y++;
+				x = 0;
+				continue;
+			}
+			if (y >= ROWS) break;
+			if (x < COLS) {
+				targets[t][y * COLS + x] = texts[t][i];
+			}
+			x++;
+		}
+	}
+
+	for (int cell = 0; cell < ROWS * COLS; cell++) {
+		switch (sim->base[cell]) {
+		case '@':
+			sim->player = cell;
+			sim->base[cell] = '.';
+			break;
+		case '%':
+			sim->box_at[cell] = 1;
+			sim->box_count++;
+			sim->base[cell] = '.';
+			break;
+		case '<': case '>': case '^': case 'v':
+			sim->base[cell] = '_';
+			break;
+		case '~':
+			sim->base[cell] = '=';
+			break;
+		}
+	}
+	return (sim->box_count > max_boxes) ? 2 : 0;
+}
+
+int sim_status(const char* base, const char* persist, const int player) {
+	const char terrain = sim_terrain(base, persist, player);
+	if (terrain == 'P') {
+		return SIM_WIN;
+	}
+	return (terrain == '_' || terrain == ' ') ? SIM_DEATH : SIM_PLAYING;
+}
+
+// Plays one move (0 up, 1 left, 2 down, 3 right), returns a SIM_* status
+int sim_step(char* base, const char* persist, unsigned char* box_at, int* player, const int dir, int* moved, int* pushes) {
+	const int x = *player % COLS + gen_dirs[dir][0];
+	const int y = *player / COLS + gen_dirs[dir][1];
+	*moved = 0;
+	if (x >= 0 && x < COLS && y >= 0 && y < ROWS) {
+		const int target = y * COLS + x;
+		int blocked = 0;
+		if (box_at[target]) {
+			const int box_x = x + gen_dirs[dir][0];
+			const int box_y = y + gen_dirs[dir][1];
+			if (box_x >= 0 && box_x < COLS && box_y >= 0 && box_y < ROWS) {
+				const int next = box_y * COLS + box_x;
+				const char cell = box_at[next] ? '%' : sim_terrain(base, persist, next);
+				if (cell == '.' || cell == '_' || cell == ' ') {
+					box_at[target] = 0;
+					(*pushes)++;
+					if (cell == '.') {
+						box_at[next] = 1;
+					} else if (cell == '_') {
+						base[next] = '.';    // Filled in, a persist hazard stays
+					}
+				} else if (cell == '=') {
+					blocked = 1;
+				}
+			}
+		}
+		if (!blocked && !box_at[target] && sim_terrain(base, persist, target) != '#') {
+			*player = target;
+			*moved = 1;
+		}
+	}
+
+	const char under = base[*player];
+	if (under != '.' && under != '_' && under != ' ' && under != 'P' && persist[*player] == '.') {
+		base[*player] = '.';
+	}
+	return sim_status(base, persist, *player);
+}
+
+int move_direction(const char move) {
+	switch (move) {
+	case 'w': case 'W': return 0;
+	case 'a': case 'A': return 1;
+	case 's': case 'S': return 2;
+	case 'd': case 'D': return 3;
+	default: return -1;
+	}
+}
+
+void verify_entry_run(const sim_map* map, verify_entry* entry) {
+	char base[ROWS * COLS];
+	unsigned char box_at[ROWS * COLS];
+	memcpy(base, map->base, sizeof(base));
+	memcpy(box_at, map->box_at, sizeof(box_at));
+	int player = map->player;
+
+	entry->moves_made = 0;
+	entry->pushes = 0;
+	entry->result = sim_status(base, map->persist, player);
+	for (int i = 0; entry->moves[i] != '\0' && entry->result == SIM_PLAYING; i++) {
+		const int dir = move_direction(entry->moves[i]);
+		if (dir < 0) {
+			entry->result = -1;
+			return;
+		}
+		int moved;
+		entry->result = sim_step(base, map->persist, box_at, &player, dir, &moved, &entry->pushes);
+		entry->moves_made += moved;
+	}
+}
+
+void* verify_worker(void* arg) {
+	verify_job* job = (verify_job*)arg;
+	TRACE_THREAD("verifier");
+	long long replayed = 0;
+	int index;
+	while ((index = __atomic_fetch_add(&job->next_entry, 1, __ATOMIC_RELAXED)) < job->count) {
+		verify_entry* entry = &job->entries[index];
+		if (entry->map >= 0) {
+			verify_entry_run(&job->maps[entry->map], entry);
+			replayed += (long long)strlen(entry->moves);
+		}
+	}
+	__atomic_fetch_add(&job->moves_replayed, replayed, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Reads "<map> <moves>" lines from stdin and prints one verdict per line, in input order
+int handle_verify(int argc, char *argv[]) {
+	long thread_count = (argc > 2) ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (thread_count < 1) {
+		thread_count = 1;
+	}
+
+	int capacity = 1024;
+	verify_job job = { .entries = malloc(capacity * sizeof(verify_entry)), .count = 0 };
+	int map_capacity = 16;
+	int map_count = 0;
+	char** map_paths = malloc(map_capacity * sizeof(char*));
+	int* map_results = malloc(map_capacity * sizeof(int));
+	job.maps = malloc(map_capacity * sizeof(sim_map));
+	if (job.entries == NULL || map_paths == NULL || map_results == NULL || job.maps == NULL) {
+		perror("Failed to allocate memory for verification");
+		exit(EXIT_FAILURE);
+	}
+
+	char* line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, stdin) != -1) {
+		char* saveptr;
+		char* path = strtok_r(line, " \t\r\n", &saveptr);
+		if (path == NULL) {
+			continue;
+		}
+		char* moves = strtok_r(NULL, " \t\r\n", &saveptr);
+
+		if (job.count == capacity) {
+			capacity *= 2;
+			verify_entry* grown = realloc(job.entries, capacity * sizeof(verify_entry));
+			if (grown == NULL) {
+				perror("Failed to reallocate memory for verification");
+				exit(EXIT_FAILURE);
+			}
+			job.entries = grown;
+		}
+		verify_entry* entry = &job.entries[job.count++];
+		entry->path = strdup(path);
+		entry->moves = strdup(moves != NULL ? moves : "");
+		entry->result = -1;
+		entry->moves_made = 0;
+		entry->pushes = 0;
+		if (entry->path == NULL || entry->moves == NULL) {
+			perror("Failed to allocate memory for verification");
+			exit(EXIT_FAILURE);
+		}
+
+		// Most lines share a handful of maps, each is parsed once
+		entry->map = -1;
+		for (int m = map_count - 1; m >= 0; m--) {
+			if (strcmp(map_paths[m], path) == 0) {
+				entry->map = m;
+				break;
+			}
+		}
+		if (entry->map < 0) {
+			if (map_count == map_capacity) {
+				map_capacity *= 2;
+				char** grown_paths = realloc(map_paths, map_capacity * sizeof(char*));
+				int* grown_results = realloc(map_results, map_capacity * sizeof(int));
+				sim_map* grown_maps = realloc(job.maps, map_capacity * sizeof(sim_map));
+				if (grown_paths == NULL || grown_results == NULL || grown_maps == NULL) {
+					perror("Failed to reallocate memory for verification");
+					exit(EXIT_FAILURE);
+				}
+				map_paths = grown_paths;
+				map_results = grown_results;
+				job.maps = grown_maps;
+			}
+			const size_t length = strlen(path);
+			char filename[length + 5];
+			snprintf(filename, sizeof(filename), (length > 4 && strcmp(path + length - 4, ".map") == 0) ? "%s" : "%s.map", path);
+			map_paths[map_count] = (char*)entry->path;
+			map_results[map_count] = sim_load(filename, &job.maps[map_count]);
+			entry->map = map_count++;
+		}
+		if (map_results[entry->map] != 0) {
+			entry->result = (map_results[entry->map] == 3) ? -3 : -2;
+			entry->map = -1;
+		}
+	}
+	free(line);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_t threads[thread_count];
+	for (long t = 0; t < thread_count; t++) {
+		if (pthread_create(&threads[t], NULL, verify_worker, &job) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (long t = 0; t < thread_count; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	int wins = 0;
+	for (int i = 0; i < job.count; i++) {
+		const verify_entry* entry = &job.entries[i];
+		const char* verdict;
+		switch (entry->result) {
+		case SIM_WIN: verdict = "win"; wins++; break;
+		case SIM_DEATH: verdict = "death"; break;
+		case SIM_PLAYING: verdict = "incomplete"; break;
+		case -3: verdict = "missing-map"; break;
+		case -2: verdict = "bad-map"; break;
+		default: verdict = "bad-moves"; break;
+		}
+		printf("%s %s %d %d\n", entry->path, verdict, entry->moves_made, entry->pushes);
+	}
+
+	const double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "Verified %d solutions (%d wins) on %d maps, %lld moves in %.3fs (%.0f moves/s).\n",
+		job.count, wins, map_count, job.moves_replayed, seconds, seconds > 0 ? (double)job.moves_replayed / seconds : 0.0);
+
+	for (int i = 0; i < job.count; i++) {
+		free((char*)job.entries[i].path);
+		free((char*)job.entries[i].moves);
+	}
+	free(job.entries);
+	free(job.maps);
+	free(map_paths);
+	free(map_results);
+	return EXIT_SUCCESS;
+}
+
+#define ENV_MAGIC 0x45564743u    // "CGVE"
+#define ENV_RESET 4               // Move byte that restarts an instance
+#define ENV_MIN_SLICE 1024         // Fewest instances worth a thread of their own
+
+// Many copies of one map stepped together. State is kept as parallel
+// arrays (instance i owns cells [i * ROWS * COLS, (i + 1) * ROWS * COLS))
+// so the passes that do not depend on push resolution are plain loops.
+// Instances are split into fixed ranges, one per thread, so every step of
+// an instance runs on the same core. Workers wait on step_start between steps.
+typedef struct env_batch env_batch;
+
+typedef struct {
+	env_batch* env;
+	int first;
+	int last;
+} env_slice;
+
+struct env_batch {
+	int count;
+	const sim_map* start;
+	unsigned char start_obs[ROWS * COLS];
+	char* base;
+	unsigned char* box_at;
+	int* player;
+	int* status;
+	unsigned char* obs;
+	const unsigned char* moves;
+	signed char* rewards;
+	unsigned char* done;
+	int thread_count;
+	pthread_t* threads;
+	env_slice* slices;
+	pthread_barrier_t step_start;
+	pthread_barrier_t step_end;
+	volatile int stopping;
+};
+
+typedef struct {
+	unsigned int magic;
+	unsigned int count;
+	unsigned int rows;
+	unsigned int cols;
+} env_header;
+
+// Observations are the composed glyphs, ROWS * COLS bytes per instance.
+// The pointers are restrict so -O2 vectorizes this without an alias check.
+void env_compose(const char* restrict base, const char* restrict persist, const unsigned char* restrict box_at, const int player, unsigned char* restrict out) {
+	// Selects are done with masks so the compiler can vectorize this
+	for (int c = 0; c < ROWS * COLS; c++) {
+		const unsigned char overlay = -(unsigned char)(persist[c] != '.');
+		const unsigned char terrain = (persist[c] & overlay) | (base[c] & ~overlay);
+		const unsigned char shown = (unsigned char)-(terrain == '#') | (unsigned char)-(terrain == '=') | (unsigned char)-(terrain == '_')
+				| (unsigned char)-(terrain == ' ') | (unsigned char)-(terrain == 'P');
+		const unsigned char box = -(unsigned char)(box_at[c] != 0);
+		out[c] = (box & '%') | (~box & ((terrain & shown) | ('.' & ~shown)));
+	}
+	const unsigned char under = out[player];
+	if (under != '_' && under != ' ' && under != 'P') {
+		out[player] = '@';
+	}
+}
+
+void env_reset(env_batch* env, const int i) {
+	memcpy(&env->base[i * ROWS * COLS], env->start->base, ROWS * COLS);
+	memcpy(&env->box_at[i * ROWS * COLS], env->start->box_at, ROWS * COLS);
+	memcpy(&env->obs[i * ROWS * COLS], env->start_obs, ROWS * COLS);
+	env->player[i] = env->start->player;
+	env->status[i] = SIM_PLAYING;
+}
+
+// A move only changes the cell the player left, the cell ahead and the cell a
+// pushed box lands on, so those are recomposed instead of the whole map
+void env_observe_move(env_batch* env, const int i, const int from, const int dir) {
+	const char* base = &env->base[i * ROWS * COLS];
+	const unsigned char* box_at = &env->box_at[i * ROWS * COLS];
+	unsigned char* out = &env->obs[i * ROWS * COLS];
+	for (int k = 0; k < 3; k++) {
+		const int x = from % COLS + k * gen_dirs[dir][0];
+		const int y = from / COLS + k * gen_dirs[dir][1];
+		if (x >= 0 && x < COLS && y >= 0 && y < ROWS) {
+			const int cell = y * COLS + x;
+			out[cell] = box_at[cell] ? '%' : sim_terrain(base, env->start->persist, cell);
+		}
+	}
+	const unsigned char under = out[env->player[i]];
+	if (under != '_' && under != ' ' && under != 'P') {
+		out[env->player[i]] = '@';
+	}
+}
+
+// Takes restrict parameters so no alias check is needed (GCC ignores restrict
+// on locals). GCC 12's -O2 cost model still keeps this scalar, it vectorizes
+// from -O2 -fvect-cost-model=cheap or -O3. It is two bytes per instance either way.
+void env_outcomes(const int* restrict status, signed char* restrict rewards, unsigned char* restrict done, const int count) {
+	for (int i = 0; i < count; i++) {
+		rewards[i] = (signed char)((status[i] == SIM_WIN) - (status[i] == SIM_DEATH));
+		done[i] = status[i] != SIM_PLAYING;
+	}
+}
+
+void env_step_range(env_batch* env, const int first, const int last) {
+	for (int i = first; i < last; i++) {
+		if (env->status[i] != SIM_PLAYING || env->moves[i] >= ENV_RESET) {
+			env_reset(env, i);
+			continue;
+		}
+		const int from = env->player[i];
+		int moved;
+		int pushes = 0;
+		env->status[i] = sim_step(&env->base[i * ROWS * COLS], env->start->persist, &env->box_at[i * ROWS * COLS], &env->player[i], env->moves[i], &moved, &pushes);
+		env_observe_move(env, i, from, env->moves[i]);
+	}
+	env_outcomes(&env->status[first], &env->rewards[first], &env->done[first], last - first);
+}
+
+void* env_worker(void* arg) {
+	const env_slice* slice = (const env_slice*)arg;
+	env_batch* env = slice->env;
+	TRACE_THREAD("env");
+	for (;;) {
+		pthread_barrier_wait(&env->step_start);
+		if (env->stopping) {
+			return NULL;
+		}
+		env_step_range(env, slice->first, slice->last);
+		pthread_barrier_wait(&env->step_end);
+	}
+}
+
+void env_create(env_batch* env, const sim_map* start, const int count, int thread_count) {
+	env->count = count;
+	env->start = start;
+	env->base = malloc((size_t)count * ROWS * COLS);
+	env->box_at = malloc((size_t)count * ROWS * COLS);
+	env->player = malloc(count * sizeof(int));
+	env->status = malloc(count * sizeof(int));
+	env->obs = malloc((size_t)count * ROWS * COLS);
+	env->rewards = malloc(count);
+	env->done = malloc(count);
+	// Small batches step faster than the barriers cost, keep them on one thread
+	if (thread_count > count / ENV_MIN_SLICE) {
+		thread_count = count / ENV_MIN_SLICE;
+	}
+	if (thread_count < 1) {
+		thread_count = 1;
+	}
+	env->thread_count = thread_count;
+	env->threads = malloc(thread_count * sizeof(pthread_t));
+	env->slices = malloc(thread_count * sizeof(env_slice));
+	if (env->base == NULL || env->box_at == NULL || env->player == NULL || env->status == NULL || env->obs == NULL
+			|| env->rewards == NULL || env->done == NULL || env->threads == NULL || env->slices == NULL) {
+		perror("Failed to allocate memory for environments");
+		exit(EXIT_FAILURE);
+	}
+	env_compose(start->base, start->persist, start->box_at, start->player, env->start_obs);
+	for (int i = 0; i < count; i++) {
+		env_reset(env, i);
+	}
+
+	env->stopping = 0;
+	pthread_barrier_init(&env->step_start, NULL, thread_count);
+	pthread_barrier_init(&env->step_end, NULL, thread_count);
+	for (int t = 0; t < thread_count; t++) {
+		env->slices[t] = (env_slice){ env, (int)((long long)count * t / thread_count), (int)((long long)count * (t + 1) / thread_count) };
+	}
+	// Slice 0 is stepped by the calling thread
+	for (int t = 1; t < thread_count; t++) {
+		if (pthread_create(&env->threads[t], NULL, env_worker, &env->slices[t]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void env_destroy(env_batch* env) {
+	env->stopping = 1;
+	pthread_barrier_wait(&env->step_start);
+	for (int t = 1; t < env->thread_count; t++) {
+		pthread_join(env->threads[t], NULL);
+	}
+	pthread_barrier_destroy(&env->step_start);
+	pthread_barrier_destroy(&env->step_end);
+	free(env->base);
+	free(env->box_at);
+	free(env->player);
+	free(env->status);
+	free(env->obs);
+	free(env->rewards);
+	free(env->done);
+	free(env->threads);
+	free(env->slices);
+}
+
+// Plays moves[i] (0 up, 1 left, 2 down, 3 right or ENV_RESET) on every
+// instance, updating env->obs, env->rewards and env->done. Finished instances
+// restart on their next step and report a reward of 0. Rewards are 1 for a
+// win and -1 for a death.
+void env_step(env_batch* env, const unsigned char* moves) {
+	TRACE_SCOPE("env_step");
+	env->moves = moves;
+	if (env->thread_count > 1) {
+		pthread_barrier_wait(&env->step_start);
+	}
+	env_step_range(env, env->slices[0].first, env->slices[0].last);
+	if (env->thread_count > 1) {
+		pthread_barrier_wait(&env->step_end);
+	}
+}
+
+// Binary protocol for out of process trainers. Writes an env_header and the
+// first observations, then for every <count> move bytes read from stdin
+// writes <count> observations, <count> signed rewards and <count> done flags.
+int handle_env(int argc, char *argv[]) {
+	if (argc < 4 || atoi(argv[3]) < 1) {
+		fprintf(stderr, "Usage: %s env <map> <count> [threads]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const size_t length = strlen(argv[2]);
+	char filename[length + 5];
+	snprintf(filename, sizeof(filename), (length > 4 && strcmp(argv[2] + length - 4, ".map") == 0) ? "%s" : "%s.map", argv[2]);
+	sim_map start;
+	switch (sim_load(filename, &start)) {
+	case 0:
+		break;
+	case 3:
+		fprintf(stderr, "Map not found: %s\n", filename);
+		return EXIT_FAILURE;
+	default:
+		fprintf(stderr, "Malformed map: %s\n", filename);
+		return EXIT_FAILURE;
+	}
+
+	env_batch env;
+	const int count = atoi(argv[3]);
+	const long thread_count = (argc > 4) ? atol(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN);
+	env_create(&env, &start, count, (thread_count < 1) ? 1 : (int)thread_count);
+	unsigned char* moves = malloc(count);
+	if (moves == NULL) {
+		perror("Failed to allocate memory for environments");
+		exit(EXIT_FAILURE);
+	}
+
+	const env_header header = { ENV_MAGIC, (unsigned int)count, ROWS, COLS };
+	fwrite(&header, sizeof(header), 1, stdout);
+	fwrite(env.obs, 1, (size_t)count * ROWS * COLS, stdout);
+	fflush(stdout);
+
+	while (fread(moves, 1, count, stdin) == (size_t)count) {
+		env_step(&env, moves);
+		fwrite(env.obs, 1, (size_t)count * ROWS * COLS, stdout);
+		fwrite(env.rewards, 1, count, stdout);
+		fwrite(env.done, 1, count, stdout);
+		if (fflush(stdout) != 0) {
+			break;    // Trainer went away
+		}
+	}
+
+	free(moves);
+	env_destroy(&env);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
 	setlocale(LC_ALL, "en_US.UTF-8");
+	TRACE_INIT();
+	load_keybinds(KEYBIND_FILE);
+	if (argc > 1 && strcmp(argv[1], "generate") == 0) {
+		return handle_generate(argc, argv);
+	}
+	if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+		return handle_verify(argc, argv);
+	}
+	if (argc > 1 && strcmp(argv[1], "env") == 0) {
+		return handle_env(argc, argv);
+	}
+	if (argc > 1 && strcmp(argv[1], "spectate") == 0) {
+		return handle_spectate();
+	}
+	if (argc > 1 && strcmp(argv[1], "--broadcast") == 0 && broadcast_open() != 0) {
+		return EXIT_FAILURE;
+	}
 	for (int i = 0; i < ROWS; i++) {
 		for (int j = 0; j < COLS; j++) {
 			game_state[i][j] = '.';
-			persist_array[i][j] = '.';
+			for (int l = 0; l < LAYER_COUNT; l++) {
+				layers[l][i][j] = '.';
+			}
 		}
 	}
 main_menu:
@@ -834,7 +3500,7 @@ main_menu:
 input:
 	;
 	set_nonblocking(1,0);
-	const char ch = tolower(getchar());
+	const char ch = tolower(read_key());
 	if (ch != ' ' && ch != '\n' && ch != '\t' && ch != EOF) {
 		if (isdigit(ch)) {
 			const char str[2] = {ch,'\0'};
@@ -847,7 +3513,7 @@ input:
 		case 1:
 play_menu_start:
 			;
-			char* menu_text = "=========Play Menu=========\n       1) Play Loaded Map\n       2) Load Map\n       3) Back";
+			char* menu_text = "=========Play Menu=========\n       1) Play Loaded Map\n       2) Load Map\n       3) Back\n       4) Resume Quick Save";
 			escape_flag = 0;
 			clear_screen();
 			printf("%s",menu_text);
@@ -855,7 +3521,7 @@ play_menu:
 			;
 			set_nonblocking(1,0);
 			printf("\x1B[?25l");
-			char ch1 = tolower(getchar());
+			char ch1 = tolower(read_key());
 			if (ch1 != ' ' && ch1 != '\n' && ch1 != '\t' && ch1 != EOF) {
 				unsigned short int play_state = 0;
 				if (isdigit(ch1)) {
@@ -944,6 +3610,20 @@ play_switch:
 					break;
 				case 3:
 					goto main_menu;
+				case 4:
+					switch (read_save(SAVE_FILE, &save_slot)) {
+					case 0:
+						resume_pending = 1;
+						play_state = 1;
+						goto play_switch;
+					case 3:
+						printf("\n\nNo quick save found.");
+						break;
+					default:
+						printf("\n\nQuick save is corrupted.");
+						break;
+					}
+					break;
 				default:
 					goto play_menu;
 				}